@@ -12,23 +12,56 @@
 #define NUM_TEST_BLOCKS 10
 #define TEST_BLOCKS {25,39,8,9,15,21,25,33,35,42}
 
-int main() 
+/* checks that every byte of the test blocks of ‘disk’ is a $, exits if not */
+void verifyDisk(int disk, char *diskName, char *buffer)
 {
-    int index=0; 
     int index2=0;
     int index3=0;
+    int testBlocks[NUM_TEST_BLOCKS] = TEST_BLOCKS;
+
+    for (index2 = 0; index2 < NUM_TEST_BLOCKS; index2++)
+    {
+        if (readBlock(disk,testBlocks[index2],buffer) < 0)
+        {
+            printf("] Failed to read block %i of disk %s. Exiting.\n",testBlocks[index2],diskName);
+            exit(1);
+        }
+
+        for (index3 =0; index3 < BLOCKSIZE; index3++)
+        {
+            if (buffer[index3] != '$')
+            {
+                printf("] Failed. Byte #%i of block %i of disk %s was supposed to be a \"$\". Exiting\n.",
+                       index3,testBlocks[index2],diskName);
+                exit(1);
+            }
+        }
+    }
+}
+
+/* Usage: diskTest [prefix]
+ * The disks are named <prefix>diskX.dsk, e.g. "mem:" for RAM disks or
+ * "/tmp/" for files in /tmp. The first run creates and writes them, a later
+ * run verifies the writes. A RAM disk only lasts as long as the process,
+ * so with "mem:" both steps happen in the same run. */
+int main(int argc, char *argv[]) 
+{
+    int index=0; 
+    int index2=0;
     int retValue=0;
     int disks[NUM_TEST_DISKS]; /* holds disk numbers being tested here */
-    char diskName[] = "diskX.dsk"; /* Unix file name for the disks */
+    char *prefix = (argc > 1) ? argv[1] : "";
+    char diskName[strlen(prefix) + sizeof("diskX.dsk")]; /* Unix file name for the disks */
     char *buffer; /* holds one block of information */
     int testBlocks[NUM_TEST_BLOCKS] = TEST_BLOCKS; /* to contain a number of blocks to test */
+    int memDisks = strncmp(prefix, MEM_PREFIX, strlen(MEM_PREFIX)) == 0;
 
     for (index =0; index < NUM_TEST_DISKS; index++) 
     {
         /* create a new buffer and fill it with $ */
         buffer = malloc(BLOCKSIZE * sizeof(char));
 
-        diskName[4] = '0'+index;
+        sprintf(diskName, "%sdisk%d.dsk", prefix, index);
         disks[index] = openDisk(diskName,0);
         
         if (disks[index] < 0)
@@ -39,7 +72,7 @@ int main()
 	    if (disks[index] < 0)
             {
                 printf("] openDisk() failed to create a disk. This should never happen. Exiting. \n");
-		exit(0); 
+		exit(1); 
 	    }
           
             memset(buffer,'$',BLOCKSIZE);
@@ -49,34 +82,31 @@ int main()
                 if (retValue < 0)
 		{
 		    printf("] Failed to write to block %i of disk %s. Exiting (%i).\n",testBlocks[index2],diskName,retValue);
-		    exit(0);
+		    exit(1);
 		}
                 printf("] Successfully wrote to block %i of disk %s.\n",testBlocks[index2],diskName);
             }
+
+            if (memDisks)
+            {
+                /* a RAM disk is gone once the process exits, reopen it now instead */
+                closeDisk(disks[index]);
+                disks[index] = openDisk(diskName,0);
+                if (disks[index] < 0)
+                {
+                    printf("] Failed to reopen disk %s. Exiting.\n",diskName);
+                    exit(1);
+                }
+                verifyDisk(disks[index],diskName,buffer);
+                printf("] Writes to disk %s were verified after reopening it.\n",diskName);
+            }
         }
         else
         {
 	    printf("] Existing disk %s opened.\n",diskName);
 	    /* determine if the testBlocks contain the dollar Signal. 
  * Check every single byte */
-            for (index2 = 0; index2 < NUM_TEST_BLOCKS; index2++)
-            {
-		if (readBlock(disks[index],testBlocks[index2],buffer) < 0)
-                {
-                    printf("] Failed to read block %i of disk %s. Exiting.\n",testBlocks[index2],diskName);
-                    exit(0);
-                }
-
-		for (index3 =0; index3 < BLOCKSIZE; index3++)
-                {
-                    if (buffer[index3] != '$')
-                    {
-                        printf("] Failed. Byte #%i of block %i of disk %s was supposed to be a \"$\". Exiting\n.",
-                               index3,testBlocks[index2],diskName);
-                        exit(0);
-                    }
-                }
-            }
+            verifyDisk(disks[index],diskName,buffer);
             printf("] Previous writes were varified. Now, delete the .dsk files if you want to run this test again.\n");
        } 
     }
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "tinyFS_errno.h"
+
+#define NUM_TEST_FILES 4
+#define TEST_FILE_SIZE 3000
+#define MAX_TEST_FILE_SIZE (TEST_FILE_SIZE * 3)
+
+/* Usage: fsTest [disk] [image]
+ * Runs each file system feature on ‘disk’, "fsTest.dsk" by default, and
+ * after every step checks that tfs_check finds the disk clean and that each
+ * file still holds what was last written to it. A RAM disk ("mem:<name>")
+ * is also saved to the Unix file ‘image’, "fsTestSaved.dsk" by default,
+ * and loaded back. */
+
+static char *diskName;
+static char *imageName;
+static char *fileNames[NUM_TEST_FILES] = {"alpha", "beta", "gamma", "delta"};
+static char contents[NUM_TEST_FILES][MAX_TEST_FILE_SIZE]; /* what each file should hold */
+static int sizes[NUM_TEST_FILES]; /* -1 for a file that should not exist */
+
+static void fail(char *step, char *what, int result)
+{
+    printf("] Failed after %s: %s (%i). Exiting.\n", step, what, result);
+    exit(1);
+}
+
+static void fillFile(int file, int size, char seed)
+{
+    int index;
+    for (index = 0; index < size; index++)
+        contents[file][index] = seed + index % 7;
+    sizes[file] = size;
+}
+
+static fileDescriptor openFile(char *step, int file)
+{
+    fileDescriptor fd = tfs_openFile(fileNames[file]);
+    if (fd < 0) fail(step, "tfs_openFile", fd);
+    return fd;
+}
+
+static void writeFile(char *step, int file)
+{
+    int result = tfs_writeFile(openFile(step, file), contents[file], sizes[file]);
+    if (result < 0) fail(step, "tfs_writeFile", result);
+}
+
+/* checks the disk and the content of every file */
+static void verify(char *step)
+{
+    CheckReport report;
+    int file, index, result;
+    char byte;
+
+    result = tfs_check(diskName, 0, &report);
+    if (result != 0) fail(step, "tfs_check found problems", result);
+    for (file = 0; file < NUM_TEST_FILES; file++)
+    {
+        if (sizes[file] < 0) continue;
+        fileDescriptor fd = openFile(step, file);
+        if (tfs_seek(fd, 0) < 0) fail(step, "tfs_seek", fd);
+        for (index = 0; tfs_readByte(fd, &byte) == 0; index++)
+        {
+            if (index >= sizes[file] || byte != contents[file][index])
+            {
+                printf("] Byte #%i of %s is wrong after %s.\n", index, fileNames[file], step);
+                exit(1);
+            }
+        }
+        if (index != sizes[file])
+        {
+            printf("] %s holds %i bytes instead of %i after %s.\n", fileNames[file], index, sizes[file], step);
+            exit(1);
+        }
+    }
+    printf("] %s: disk clean, contents verified.\n", step);
+}
+
+static void testWrite(void)
+{
+    int file;
+    for (file = 0; file < NUM_TEST_FILES; file++)
+    {
+        fillFile(file, TEST_FILE_SIZE / (file + 1), 'a' + file);
+        writeFile("write", file);
+    }
+    verify("write");
+}
+
+static void testCompression(void)
+{
+    int result = tfs_setCompression(openFile("compression", 1), 1);
+    if (result < 0) fail("compression", "tfs_setCompression", result);
+    fillFile(1, TEST_FILE_SIZE * 2, 'c');
+    writeFile("compression", 1);
+    verify("compression");
+    fillFile(1, 100, 'i');
+    writeFile("inline write to a compressed file", 1);
+    verify("inline write to a compressed file");
+    fillFile(1, TEST_FILE_SIZE * 2, 'c');
+    writeFile("compression", 1);
+    verify("compression");
+}
+
+static void testDedup(void)
+{
+    DedupStats stats;
+    int result = tfs_setDedup(1);
+    if (result < 0) fail("dedup", "tfs_setDedup", result);
+    memcpy(contents[2], contents[0], sizes[0]);
+    sizes[2] = sizes[0];
+    writeFile("dedup", 2);
+    verify("dedup");
+    result = tfs_dedupStats(&stats);
+    if (result < 0) fail("dedup", "tfs_dedupStats", result);
+    if (stats.physicalBlocks >= stats.logicalBlocks) fail("dedup", "a copy of a file shared no blocks", stats.physicalBlocks);
+    fillFile(2, TEST_FILE_SIZE, 'd');
+    writeFile("write to a deduplicated file", 2);
+    verify("write to a deduplicated file");
+}
+
+static void testClone(void)
+{
+    int result = tfs_clone(fileNames[1], fileNames[3]);
+    if (result < 0) fail("clone", "tfs_clone", result);
+    memcpy(contents[3], contents[1], sizes[1]);
+    sizes[3] = sizes[1];
+    verify("clone");
+    fillFile(3, 700, 'x');
+    writeFile("write to a clone", 3);
+    verify("write to a clone");
+}
+
+static void testSnapshot(void)
+{
+    char saved[MAX_TEST_FILE_SIZE];
+    int savedSize = sizes[0];
+    int savedBeta = sizes[1];
+    int result = tfs_snapshot();
+    if (result < 0) fail("snapshot", "tfs_snapshot", result);
+    verify("snapshot");
+
+    memcpy(saved, contents[0], savedSize);
+    fillFile(0, 1200, 'q');
+    writeFile("write after snapshot", 0);
+    result = tfs_deleteFile(openFile("delete after snapshot", 1));
+    if (result < 0) fail("delete after snapshot", "tfs_deleteFile", result);
+    sizes[1] = -1;
+    verify("write and delete after snapshot");
+
+    result = tfs_restoreSnapshot();
+    if (result < 0) fail("restore", "tfs_restoreSnapshot", result);
+    memcpy(contents[0], saved, savedSize);
+    sizes[0] = savedSize;
+    sizes[1] = savedBeta;
+    verify("restore");
+    result = tfs_dropSnapshot();
+    if (result < 0) fail("drop snapshot", "tfs_dropSnapshot", result);
+    verify("drop snapshot");
+    if (tfs_restoreSnapshot() != NO_SNAPSHOT) fail("drop snapshot", "tfs_restoreSnapshot did not fail", 0);
+}
+
+static void testFallocate(void)
+{
+    fileDescriptor fd = openFile("fallocate", 3);
+    int result = tfs_fallocate(fd, TEST_FILE_SIZE * 2);
+    if (result < 0) fail("fallocate", "tfs_fallocate", result);
+    verify("fallocate");
+    fillFile(3, TEST_FILE_SIZE, 'f');
+    writeFile("write to a reservation", 3);
+    verify("write to a reservation");
+    fillFile(3, 100, 'f');
+    writeFile("small write to a reservation", 3);
+    verify("small write to a reservation");
+    fillFile(3, TEST_FILE_SIZE * 2 + 500, 'o');
+    writeFile("write past a reservation", 3);
+    verify("write past a reservation");
+    result = tfs_fallocate(fd, 0);
+    if (result < 0) fail("drop reservation", "tfs_fallocate", result);
+    verify("drop reservation");
+    if (tfs_fallocate(fd, MAX_BLOCKS * BLOCKSIZE) != OUT_OF_BLOCKS) fail("oversized reservation", "tfs_fallocate did not fail", 0);
+    verify("oversized reservation");
+}
+
+/* compares each pinned ref with the bytes it pointed at when it was taken */
+static void checkRefs(char *step, char **refs, int *lengths, char saved[][BLOCKSIZE])
+{
+    int page;
+    for (page = 0; page < REF_PAGES; page++)
+        if (memcmp(refs[page], saved[page], lengths[page]) != 0) fail(step, "a pinned page changed", page);
+    printf("] %s: pinned pages unchanged.\n", step);
+}
+
+static void testReadRef(void)
+{
+    char *refs[REF_PAGES];
+    char saved[REF_PAGES][BLOCKSIZE];
+    int lengths[REF_PAGES];
+    char *ref;
+    int length, page, result;
+    fileDescriptor fd = openFile("readRef", 0);
+
+    /* one ref into each of the first REF_PAGES extents pins every page */
+    for (page = 0; page < REF_PAGES; page++)
+    {
+        result = tfs_readRef(fd, page * (BLOCKSIZE - 3), &refs[page], &lengths[page]);
+        if (result < 0) fail("readRef", "tfs_readRef", result);
+        if (refs[page] == NULL || memcmp(refs[page], contents[0] + page * (BLOCKSIZE - 3), lengths[page]) != 0)
+            fail("readRef", "wrong data at a ref", page);
+        memcpy(saved[page], refs[page], lengths[page]);
+    }
+    result = tfs_readRef(fd, REF_PAGES * (BLOCKSIZE - 3), &ref, &length);
+    if (result != TOO_MANY_REFERENCES) fail("readRef", "pinning one page too many did not fail", result);
+
+    fillFile(0, TEST_FILE_SIZE, 'p');
+    writeFile("rewrite under refs", 0);
+    verify("rewrite under refs");
+    checkRefs("rewrite under refs", refs, lengths, saved);
+    result = tfs_defrag(0);
+    if (result < 0) fail("defrag under refs", "tfs_defrag", result);
+    verify("defrag under refs");
+    checkRefs("defrag under refs", refs, lengths, saved);
+
+    for (page = 0; page < REF_PAGES; page++)
+    {
+        result = tfs_release(refs[page]);
+        if (result < 0) fail("release", "tfs_release", result);
+    }
+    if (tfs_release(refs[0]) != INVALID_REF) fail("double release", "tfs_release did not fail", 0);
+    /* released pages are reused, and show the new content */
+    result = tfs_readRef(fd, 0, &ref, &length);
+    if (result < 0) fail("readRef after release", "tfs_readRef", result);
+    if (ref == NULL || memcmp(ref, contents[0], length) != 0) fail("readRef after release", "old data at a ref", 0);
+    result = tfs_release(ref);
+    if (result < 0) fail("readRef after release", "tfs_release", result);
+}
+
+static void testDefrag(void)
+{
+    FragStats stats;
+    int result = tfs_deleteFile(openFile("delete", 2));
+    if (result < 0) fail("delete", "tfs_deleteFile", result);
+    sizes[2] = -1;
+    fillFile(0, TEST_FILE_SIZE * 2, 'g');
+    writeFile("fragmenting write", 0);
+    verify("fragmenting write");
+    /* a few moves at a time, as on a busy file system, then the rest */
+    result = tfs_defrag(4);
+    if (result < 0) fail("partial defrag", "tfs_defrag", result);
+    verify("partial defrag");
+    result = tfs_defrag(0);
+    if (result != 0) fail("defrag", "tfs_defrag", result);
+    verify("defrag");
+    result = tfs_fragStats(&stats);
+    if (result < 0) fail("defrag", "tfs_fragStats", result);
+    if (stats.misplacedBlocks != 0) fail("defrag", "blocks left out of place", stats.misplacedBlocks);
+}
+
+/* returns the block of extent ‘n’ of file ‘file’, read straight from the disk */
+static int findExtent(int disk, int file, int n)
+{
+    Inode inode;
+    FileExtent extent;
+    int block = 1;
+    do
+    {
+        if (readBlock(disk, block, &inode) < 0) return -1;
+        block = inode.nextInodePtr;
+    } while (strcmp((char *) inode.fileName, fileNames[file]) != 0 && block != -1);
+    block = inode.firstFileExtentPtr;
+    while (n-- > 0 && block != -1)
+    {
+        if (readBlock(disk, block, &extent) < 0) return -1;
+        block = extent.nextDataBlock;
+    }
+    return block;
+}
+
+static void testRepair(void)
+{
+    CheckReport report;
+    char block[BLOCKSIZE];
+    int index, result;
+
+    result = tfs_setDedup(1);
+    if (result < 0) fail("repair", "tfs_setDedup", result);
+    for (index = 0; index < 3 * (BLOCKSIZE - 3); index++)
+        contents[2][index] = rand();
+    sizes[2] = 3 * (BLOCKSIZE - 3);
+    writeFile("three extent write", 2);
+    verify("three extent write");
+
+    /* break the middle extent, which cuts the file after its first one */
+    tfs_unmount();
+    int disk = openDisk(diskName, 0);
+    int middle = findExtent(disk, 2, 1);
+    if (middle < 0) fail("repair", "finding the middle extent", middle);
+    readBlock(disk, middle, block);
+    block[0] = 0;
+    writeBlock(disk, middle, block);
+    closeDisk(disk);
+    result = tfs_check(diskName, 1, &report);
+    if (result <= 0 || !report.repaired) fail("repair", "tfs_check did not repair", result);
+    if (report.staleFingerprints == 0) fail("repair", "cut extents kept their fingerprints", 0);
+    sizes[2] = BLOCKSIZE - 3;
+    result = tfs_mount(diskName);
+    if (result < 0) fail("repair", "tfs_mount", result);
+    verify("repair");
+
+    /* the same content again must not be deduplicated against the freed blocks */
+    sizes[2] = 3 * (BLOCKSIZE - 3);
+    writeFile("write after repair", 2);
+    verify("write after repair");
+    fillFile(3, TEST_FILE_SIZE, 'r');
+    writeFile("write after repair", 3);
+    verify("write after repair");
+}
+
+static void mountCopy(char *step, char *copy)
+{
+    char *original = diskName;
+    int result = tfs_mount(copy);
+    if (result < 0) fail(step, "tfs_mount", result);
+    diskName = copy;
+    verify(step);
+    diskName = original;
+    tfs_unmount();
+}
+
+static void testSaveLoad(void)
+{
+    if (strncmp(diskName, MEM_PREFIX, strlen(MEM_PREFIX)) != 0) return;
+    int result = tfs_unmount();
+    if (result < 0) fail("save", "tfs_unmount", result);
+    result = saveDisk(diskName, imageName);
+    if (result < 0) fail("save", "saveDisk", result);
+    /* the saved image is an ordinary disk file */
+    mountCopy("mount saved image", imageName);
+    result = loadDisk("mem:fsTestLoaded", imageName);
+    if (result < 0) fail("load", "loadDisk", result);
+    mountCopy("load", "mem:fsTestLoaded");
+    if (loadDisk("mem:fsTestLoaded", "/nonexistent/fsTest.dsk") >= 0) fail("load", "loading a missing file did not fail", 0);
+    result = tfs_mount(diskName);
+    if (result < 0) fail("load", "tfs_mount", result);
+}
+
+static void testRemount(void)
+{
+    int result = tfs_unmount();
+    if (result < 0) fail("unmount", "tfs_unmount", result);
+    result = tfs_mount(diskName);
+    if (result < 0) fail("remount", "tfs_mount", result);
+    verify("remount");
+}
+
+int main(int argc, char *argv[])
+{
+    int result;
+    diskName = (argc > 1) ? argv[1] : "fsTest.dsk";
+    imageName = (argc > 2) ? argv[2] : "fsTestSaved.dsk";
+
+    result = tfs_mkfs(diskName, MAX_BLOCKS * BLOCKSIZE);
+    if (result < 0) fail("tfs_mkfs", "tfs_mkfs", result);
+    result = tfs_mount(diskName);
+    if (result < 0) fail("tfs_mount", "tfs_mount", result);
+
+    testWrite();
+    testCompression();
+    testDedup();
+    testClone();
+    testSnapshot();
+    testFallocate();
+    testReadRef();
+    testDefrag();
+    testRepair();
+    testSaveLoad();
+    testRemount();
+
+    tfs_unmount();
+    printf("] All file system tests passed on %s.\n", diskName);
+    return 0;
+}
@@ -1,49 +1,448 @@
+#define _GNU_SOURCE // fallocate, MAP_HUGETLB
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "libDisk.h"
 
 
 #define BLOCKSIZE 256
 
-int openDisk(char *filename, int nBytes){
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define STREAM_CHUNK (1024 * 1024) // bytes per read or write when saving and loading RAM disks
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // pieces per vectored read or write, its value on Linux
+#endif
 
-    int disk;
-    if (nBytes == 0){
-        disk = open(filename, O_RDWR);
-        if (disk == -1) return -1;
-        return  disk;
+/* A RAM disk's blocks, kept by name so that the disk outlives closeDisk
+like a file would and can be opened again with nBytes 0. The arena is
+an anonymous mapping, backed by huge pages when it is large enough. */
+typedef struct {
+    char *name; // NULL for an unused slot
+    char *arena;
+    size_t size;
+    size_t mapped;
+} MemDisk;
+
+static MemDisk memDisks[MAX_MEM_DISKS];
+
+static MemDisk *findMemDisk(char *name){
+    for (int i = 0; i < MAX_MEM_DISKS; i++){
+        if (memDisks[i].name != NULL && strcmp(memDisks[i].name, name) == 0) return &memDisks[i];
     }
+    return NULL;
+}
 
-    else if (nBytes < BLOCKSIZE) return -1;
+static char *mapArena(size_t size, size_t *mapped){
+    char *arena = MAP_FAILED;
+    if (size >= HUGE_PAGE_SIZE){
+        *mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (arena == MAP_FAILED){
+        //no huge pages reserved, ask for transparent ones instead
+        *mapped = size;
+        arena = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) return NULL;
+        if (size >= HUGE_PAGE_SIZE) madvise(arena, *mapped, MADV_HUGEPAGE);
+    }
+    return arena;
+}
+
+/* Sizes the RAM disk ‘name’ to ‘size’ bytes, creating it if needed. Like
+ftruncate on a file, existing contents are kept up to the new size. */
+static MemDisk *resizeMemDisk(char *name, size_t size){
+    MemDisk *mem = findMemDisk(name);
+    if (mem == NULL){
+        for (int i = 0; mem == NULL && i < MAX_MEM_DISKS; i++){
+            if (memDisks[i].name == NULL) mem = &memDisks[i];
+        }
+        if (mem == NULL) return NULL; // too many RAM disks
+        mem->arena = NULL;
+        mem->size = 0;
+    }
+    else if (mem->size == size) return mem;
+
+    size_t mapped;
+    char *arena = mapArena(size, &mapped);
+    if (arena == NULL) return NULL;
+    if (mem->arena != NULL){
+        memcpy(arena, mem->arena, mem->size < size ? mem->size : size);
+        munmap(mem->arena, mem->mapped);
+    }
+    if (mem->name == NULL) mem->name = strdup(name);
+    mem->arena = arena;
+    mem->size = size;
+    mem->mapped = mapped;
+    return mem;
+}
+
+/* An open emulated disk. A plain disk is a single Unix file. A striped
+disk spreads its blocks round robin over several member files,
+‘stripeBlocks’ consecutive blocks at a time. A RAM disk has no member
+files and keeps its blocks in ‘mem’. */
+typedef struct {
+    int nMembers; // 0 for an unused slot
+    int members[MAX_STRIPE_MEMBERS];
+    int stripeBlocks;
+    MemDisk *mem;
+} Disk;
+
+static Disk disks[MAX_DISKS];
+
+//opens (or creates, if nBytes > 0) one Unix file backing a disk
+static int openMember(char *filename, int nBytes){
+    int member;
+    if (nBytes == 0){
+        member = open(filename, O_RDWR);
+        if (member == -1) return -1;
+        return member;
+    }
 
     else {
-        disk = open(filename, O_RDWR | O_CREAT, 0666);
-        if (disk == -1) return -1;
+        member = open(filename, O_RDWR | O_CREAT, 0666);
+        if (member == -1) return -1;
         // make sure size is a multiple of BLOCKSIZE
         nBytes = nBytes - (nBytes % BLOCKSIZE);
-        if (ftruncate(disk, nBytes) == -1) {
-            close(disk);
+        if (ftruncate(member, nBytes) == -1) {
+            close(member);
             return -1; // adjusting size failed
         }
+        return member;
+    }
+}
+
+/* Opens the members of a striped disk named
+"stripe:<stripe unit in bytes>:<file>,<file>,...". Each member holds every
+nth stripe unit, so a new disk of nBytes gives each of them an equal share
+rounded up to whole stripe units. */
+static int openStriped(Disk *disk, char *name, int nBytes){
+    char *spec = name + strlen(STRIPE_PREFIX);
+    char *end;
+    long stripeUnit = strtol(spec, &end, 10);
+    if (end == spec || *end != ':' || stripeUnit <= 0 || stripeUnit % BLOCKSIZE != 0) return -1;
+    disk->stripeBlocks = stripeUnit / BLOCKSIZE;
+
+    char files[strlen(end + 1) + 1];
+    strcpy(files, end + 1);
+    char *memberNames[MAX_STRIPE_MEMBERS];
+    int nMembers = 0;
+    for (char *file = strtok(files, ","); file != NULL; file = strtok(NULL, ",")){
+        if (nMembers == MAX_STRIPE_MEMBERS) return -1;
+        memberNames[nMembers++] = file;
+    }
+    if (nMembers == 0) return -1;
+
+    int memberBytes = 0;
+    if (nBytes > 0){
+        int units = (nBytes / BLOCKSIZE + disk->stripeBlocks - 1) / disk->stripeBlocks;
+        memberBytes = (units + nMembers - 1) / nMembers * stripeUnit;
+    }
+    for (int i = 0; i < nMembers; i++){
+        int member = openMember(memberNames[i], memberBytes);
+        if (member < 0){
+            while (i-- > 0) close(disk->members[i]);
+            return -1;
+        }
+        disk->members[i] = member;
+    }
+    disk->nMembers = nMembers;
+    return 0;
+}
+
+int openDisk(char *filename, int nBytes){
+
+    if (nBytes != 0 && nBytes < BLOCKSIZE) return -1;
+
+    int disk = 0;
+    while (disk < MAX_DISKS && disks[disk].nMembers > 0) disk++;
+    if (disk == MAX_DISKS) return -1; // too many open disks
+
+    disks[disk].mem = NULL;
+    if (strncmp(filename, MEM_PREFIX, strlen(MEM_PREFIX)) == 0){
+        char *name = filename + strlen(MEM_PREFIX);
+        MemDisk *mem = (nBytes > 0) ? resizeMemDisk(name, nBytes - nBytes % BLOCKSIZE) : findMemDisk(name);
+        if (mem == NULL) return -1;
+        disks[disk].mem = mem;
+        disks[disk].members[0] = -1;
+        disks[disk].nMembers = 1;
+        disks[disk].stripeBlocks = INT_MAX;
+        return disk;
+    }
+
+    if (strncmp(filename, STRIPE_PREFIX, strlen(STRIPE_PREFIX)) == 0){
+        if (openStriped(&disks[disk], filename, nBytes) < 0) return -1;
         return disk;
     }
+
+    int member = openMember(filename, nBytes);
+    if (member < 0) return -1;
+    disks[disk].members[0] = member;
+    disks[disk].nMembers = 1;
+    disks[disk].stripeBlocks = INT_MAX; // one stripe unit covers the whole file
+    return disk;
 }
 
 int closeDisk(int disk){
-    return close(disk);
+    if (disk < 0 || disk >= MAX_DISKS || disks[disk].nMembers == 0) return -1;
+    int result = 0;
+    for (int i = 0; disks[disk].mem == NULL && i < disks[disk].nMembers; i++){
+        if (close(disks[disk].members[i]) == -1) result = -1;
+    }
+    disks[disk].nMembers = 0;
+    return result;
+}
+
+/* Finds where block ‘bNum’ lives. Returns the index of its member file and sets
+‘offset’ to the block's byte offset in it and ‘run’ to the number of
+blocks from ‘bNum’ that follow it contiguously in that file. */
+static int locateBlock(Disk *disk, int bNum, off_t *offset, int *run){
+    int unit = bNum / disk->stripeBlocks;
+    int inUnit = bNum % disk->stripeBlocks;
+    *offset = ((off_t) (unit / disk->nMembers) * disk->stripeBlocks + inUnit) * BLOCKSIZE;
+    *run = disk->stripeBlocks - inUnit;
+    return unit % disk->nMembers;
+}
+
+static Disk *lookupDisk(int disk, int bNum){
+    if (disk < 0 || disk >= MAX_DISKS || disks[disk].nMembers == 0) return NULL;
+    if (bNum < 0) return NULL;
+    return &disks[disk];
 }
 
 int readBlock(int disk, int bNum, void *block){
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) return -1;
-    if (read(disk, block, BLOCKSIZE) < BLOCKSIZE) return -1;
-    return 0;
+    return readBlocks(disk, bNum, 1, block);
 }
 
 int writeBlock(int disk, int bNum, void *block){
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) return -1;
-    if (write(disk, block, BLOCKSIZE) < BLOCKSIZE) return -1;
+    return writeBlocks(disk, bNum, 1, block);
+}
+
+//the pieces of a request that fall in one member file
+typedef struct {
+    int member;
+    off_t offset; // of the first piece, the others follow it in the file
+    struct iovec *pieces;
+    int nPieces;
+    int writing;
+    int result;
+} MemberIO;
+
+//reads or writes one member's pieces, IOV_MAX of them per call
+static void *memberIO(void *arg){
+    MemberIO *io = arg;
+    off_t offset = io->offset;
+    io->result = 0;
+    for (int i = 0; i < io->nPieces; i += IOV_MAX){
+        int n = (io->nPieces - i < IOV_MAX) ? io->nPieces - i : IOV_MAX;
+        ssize_t bytes = 0;
+        for (int j = i; j < i + n; j++) bytes += io->pieces[j].iov_len;
+        ssize_t done = io->writing ? pwritev(io->member, io->pieces + i, n, offset)
+                                   : preadv(io->member, io->pieces + i, n, offset);
+        if (done < bytes){
+            io->result = -1;
+            break;
+        }
+        offset += bytes;
+    }
+    return NULL;
+}
+
+/* Splits a request at stripe unit boundaries. A member's stripe units
+follow each other in its file, so its pieces are gathered into a single
+vectored read or write. Requests of STRIPE_PARALLEL_BYTES or more give
+each member its own thread so that they are served concurrently, smaller
+ones are issued one member after the other. */
+static int stripedIO(Disk *d, int bNum, int count, char *buffer, int writing){
+    MemberIO io[MAX_STRIPE_MEMBERS];
+    memset(io, 0, sizeof(io));
+    int maxPieces = count / d->stripeBlocks + 2;
+    struct iovec *pieces = malloc(sizeof(struct iovec) * maxPieces * d->nMembers);
+    if (pieces == NULL) return -1;
+    int size = count;
+    while (count > 0){
+        off_t offset;
+        int run;
+        int member = locateBlock(d, bNum, &offset, &run);
+        if (run > count) run = count;
+        MemberIO *target = &io[member];
+        if (target->nPieces == 0){
+            target->member = d->members[member];
+            target->offset = offset;
+            target->pieces = pieces + member * maxPieces;
+            target->writing = writing;
+        }
+        target->pieces[target->nPieces].iov_base = buffer;
+        target->pieces[target->nPieces++].iov_len = (size_t) run * BLOCKSIZE;
+        buffer += (size_t) run * BLOCKSIZE;
+        bNum += run;
+        count -= run;
+    }
+
+    pthread_t threads[MAX_STRIPE_MEMBERS];
+    int started[MAX_STRIPE_MEMBERS];
+    memset(started, 0, sizeof(started));
+    int parallel = (size_t) size * BLOCKSIZE >= STRIPE_PARALLEL_BYTES;
+    for (int i = 0; i < d->nMembers; i++){
+        if (io[i].nPieces == 0) continue;
+        //the calling thread serves the last member itself
+        if (parallel && i < d->nMembers - 1) started[i] = pthread_create(&threads[i], NULL, memberIO, &io[i]) == 0;
+        if (!started[i]) memberIO(&io[i]);
+    }
+    int result = 0;
+    for (int i = 0; i < d->nMembers; i++){
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (io[i].result < 0) result = -1;
+    }
+    free(pieces);
+    return result;
+}
+
+/* The batched calls read or write ‘count’ consecutive blocks. On a striped
+disk a request reaches each member it spans as one vectored I/O, see
+stripedIO. */
+int readBlocks(int disk, int bNum, int count, void *blocks){
+    Disk *d = lookupDisk(disk, bNum);
+    if (d == NULL) return -1;
+    if (d->mem != NULL){
+        if ((size_t) (bNum + count) * BLOCKSIZE > d->mem->size) return -1;
+        memcpy(blocks, d->mem->arena + (size_t) bNum * BLOCKSIZE, (size_t) count * BLOCKSIZE);
+        return 0;
+    }
+    off_t offset;
+    int run;
+    int member = d->members[locateBlock(d, bNum, &offset, &run)];
+    //a request within one stripe unit needs no splitting
+    if (run >= count) return (pread(member, blocks, (size_t) count * BLOCKSIZE, offset) < (ssize_t) count * BLOCKSIZE) ? -1 : 0;
+    return stripedIO(d, bNum, count, blocks, 0);
+}
+
+int writeBlocks(int disk, int bNum, int count, void *blocks){
+    Disk *d = lookupDisk(disk, bNum);
+    if (d == NULL) return -1;
+    if (d->mem != NULL){
+        if ((size_t) (bNum + count) * BLOCKSIZE > d->mem->size) return -1;
+        memcpy(d->mem->arena + (size_t) bNum * BLOCKSIZE, blocks, (size_t) count * BLOCKSIZE);
+        return 0;
+    }
+    off_t offset;
+    int run;
+    int member = d->members[locateBlock(d, bNum, &offset, &run)];
+    if (run >= count) return (pwrite(member, blocks, (size_t) count * BLOCKSIZE, offset) < (ssize_t) count * BLOCKSIZE) ? -1 : 0;
+    return stripedIO(d, bNum, count, blocks, 1);
+}
+
+/* Gives the host storage behind ‘count’ blocks from ‘bNum’ back to the
+host file system by punching holes, which read back as zeros. Pieces that
+end up next to each other in a member file are punched together, and only
+whole TRIM_ALIGN units are released since a partial one frees nothing.
+Hosts that cannot punch holes are left as they are. A RAM disk gives its
+pages back to the kernel instead. */
+int trimBlocks(int disk, int bNum, int count){
+    Disk *d = lookupDisk(disk, bNum);
+    if (d == NULL) return -1;
+    if (d->mem != NULL){
+        size_t first = ((size_t) bNum * BLOCKSIZE + TRIM_ALIGN - 1) / TRIM_ALIGN * TRIM_ALIGN;
+        size_t last = (size_t) (bNum + count) * BLOCKSIZE / TRIM_ALIGN * TRIM_ALIGN;
+        if (last > d->mem->size) last = d->mem->size / TRIM_ALIGN * TRIM_ALIGN;
+        if (last > first) madvise(d->mem->arena + first, last - first, MADV_DONTNEED);
+        return 0;
+    }
+    off_t start[MAX_STRIPE_MEMBERS];
+    off_t end[MAX_STRIPE_MEMBERS];
+    memset(end, 0, sizeof(end));
+    memset(start, 0, sizeof(start));
+    for (;;){
+        off_t offset = 0;
+        int run = 0;
+        int member = 0;
+        if (count > 0){
+            member = locateBlock(d, bNum, &offset, &run);
+            if (run > count) run = count;
+        }
+        for (int i = 0; i < d->nMembers; i++){
+            //a member's range is punched once a piece does not extend it
+            if (end[i] == 0 || (count > 0 && (i != member || end[i] == offset))) continue;
+            off_t first = (start[i] + TRIM_ALIGN - 1) / TRIM_ALIGN * TRIM_ALIGN;
+            off_t last = end[i] / TRIM_ALIGN * TRIM_ALIGN;
+#ifdef FALLOC_FL_PUNCH_HOLE
+            if (last > first) fallocate(d->members[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, last - first);
+#endif
+            end[i] = 0;
+        }
+        if (count == 0) break;
+        if (end[member] == 0) start[member] = offset;
+        end[member] = offset + (off_t) run * BLOCKSIZE;
+        bNum += run;
+        count -= run;
+    }
     return 0;
 }
+
+/* Makes every block written to ‘disk’ so far durable, with fdatasync on
+each of its member files. A RAM disk has nothing to make durable.
+Returns 0 or -1. */
+int syncDisk(int disk){
+    Disk *d = lookupDisk(disk, 0);
+    if (d == NULL) return -1;
+    int result = 0;
+    for (int i = 0; d->mem == NULL && i < d->nMembers; i++){
+        if (fdatasync(d->members[i]) == -1) result = -1;
+    }
+    return result;
+}
+
+/* Writes the RAM disk ‘name’ to the Unix file ‘filename’, replacing it,
+so it can be brought back with loadDisk. The image is streamed in
+large sequential writes. Returns 0 or -1. */
+int saveDisk(char *name, char *filename){
+    if (strncmp(name, MEM_PREFIX, strlen(MEM_PREFIX)) != 0) return -1;
+    MemDisk *mem = findMemDisk(name + strlen(MEM_PREFIX));
+    if (mem == NULL) return -1;
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file == -1) return -1;
+    for (size_t done = 0; done < mem->size;){
+        size_t length = mem->size - done < STREAM_CHUNK ? mem->size - done : STREAM_CHUNK;
+        ssize_t written = write(file, mem->arena + done, length);
+        if (written <= 0){
+            close(file);
+            return -1;
+        }
+        done += written;
+    }
+    return close(file);
+}
+
+/* Fills the RAM disk ‘name’ from the image in the Unix file ‘filename’,
+creating the RAM disk or resizing it to the file's size. Returns 0 or -1. */
+int loadDisk(char *name, char *filename){
+    if (strncmp(name, MEM_PREFIX, strlen(MEM_PREFIX)) != 0) return -1;
+    int file = open(filename, O_RDONLY);
+    if (file == -1) return -1;
+    struct stat info;
+    if (fstat(file, &info) == -1 || info.st_size < BLOCKSIZE){
+        close(file);
+        return -1;
+    }
+    MemDisk *mem = resizeMemDisk(name + strlen(MEM_PREFIX), info.st_size - info.st_size % BLOCKSIZE);
+    if (mem == NULL){
+        close(file);
+        return -1;
+    }
+    for (size_t done = 0; done < mem->size;){
+        size_t length = mem->size - done < STREAM_CHUNK ? mem->size - done : STREAM_CHUNK;
+        ssize_t got = read(file, mem->arena + done, length);
+        if (got <= 0){
+            close(file);
+            return -1;
+        }
+        done += got;
+    }
+    return close(file);
+}
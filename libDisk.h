@@ -5,6 +5,15 @@
 #include <fcntl.h>
 
 #define BLOCKSIZE 256
+#define MAX_DISKS 64 // disks open at once
+#define MAX_STRIPE_MEMBERS 8 // files one striped disk can span
+#ifndef STRIPE_PARALLEL_BYTES
+#define STRIPE_PARALLEL_BYTES 8192 // requests this large reach the members of a striped disk concurrently
+#endif
+#define STRIPE_PREFIX "stripe:" // "stripe:<unit bytes>:<file>,<file>,..."
+#define MEM_PREFIX "mem:" // RAM disk, never touches the host file system
+#define MAX_MEM_DISKS 16 // RAM disks that can exist at once
+#define TRIM_ALIGN 4096 // host storage is released in units of this many bytes
 
 int openDisk(char *filename, int nBytes);
 
@@ -12,4 +21,16 @@ int closeDisk(int disk);
 
 int readBlock(int disk, int bNum, void *block);
 
-int writeBlock(int disk, int bNum, void *block);
\ No newline at end of file
+int writeBlock(int disk, int bNum, void *block);
+
+int readBlocks(int disk, int bNum, int count, void *blocks);
+
+int writeBlocks(int disk, int bNum, int count, void *blocks);
+
+int trimBlocks(int disk, int bNum, int count);
+
+int syncDisk(int disk);
+
+int saveDisk(char *name, char *filename);
+
+int loadDisk(char *name, char *filename);
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libLZ.h"
+
+/* A small LZ77 codec in the style of LZ4. The output is a sequence of
+tokens: the high nibble of the token is the literal count and the low
+nibble the match length minus LZ_MIN_MATCH, each extended by 255-valued
+bytes when it is 15. The literals follow, then a 2-byte little endian
+match offset. The last sequence carries literals only. */
+
+static unsigned int read32(const unsigned char *p){
+    unsigned int value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hash32(unsigned int value){
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int writeLength(unsigned char *dst, int out, int dstCap, int length){
+    while (length >= 255){
+        if (out >= dstCap) return -1;
+        dst[out++] = 255;
+        length -= 255;
+    }
+    if (out >= dstCap) return -1;
+    dst[out++] = length;
+    return out;
+}
+
+static int emitSequence(unsigned char *dst, int out, int dstCap, const unsigned char *literals,
+                        int literalLength, int offset, int matchLength){
+    if (out >= dstCap) return -1;
+    int tokenPos = out++;
+    int litNibble = literalLength < 15 ? literalLength : 15;
+    int matchNibble = 0;
+    if (litNibble == 15 && (out = writeLength(dst, out, dstCap, literalLength - 15)) < 0) return -1;
+    if (out + literalLength > dstCap) return -1;
+    memcpy(dst + out, literals, literalLength);
+    out += literalLength;
+    if (matchLength > 0){
+        if (out + 2 > dstCap) return -1;
+        dst[out++] = offset & 0xff;
+        dst[out++] = offset >> 8;
+        matchLength -= LZ_MIN_MATCH;
+        matchNibble = matchLength < 15 ? matchLength : 15;
+        if (matchNibble == 15 && (out = writeLength(dst, out, dstCap, matchLength - 15)) < 0) return -1;
+    }
+    dst[tokenPos] = (litNibble << 4) | matchNibble;
+    return out;
+}
+
+/* Compresses srcLen bytes of src into dst. Returns the compressed length,
+or -1 if it does not fit in dstCap bytes. */
+int lzCompress(const char *src, int srcLen, char *dst, int dstCap){
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+    int anchor = 0;
+    int pos = 0;
+    int outLen = 0;
+    while (pos + LZ_MIN_MATCH <= srcLen){
+        unsigned int sequence = read32(in + pos);
+        int h = hash32(sequence);
+        int candidate = table[h];
+        table[h] = pos;
+        if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || read32(in + candidate) != sequence){
+            pos++;
+            continue;
+        }
+        int matchLength = LZ_MIN_MATCH;
+        while (pos + matchLength < srcLen && in[candidate + matchLength] == in[pos + matchLength]) matchLength++;
+        outLen = emitSequence(out, outLen, dstCap, in + anchor, pos - anchor, pos - candidate, matchLength);
+        if (outLen < 0) return -1;
+        pos += matchLength;
+        anchor = pos;
+    }
+    return emitSequence(out, outLen, dstCap, in + anchor, srcLen - anchor, 0, 0);
+}
+
+/* Decompresses srcLen bytes of src into dst. Returns the decompressed
+length, or -1 if the input is malformed or does not fit in dstCap bytes. */
+int lzDecompress(const char *src, int srcLen, char *dst, int dstCap){
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int ip = 0;
+    int op = 0;
+    while (ip < srcLen){
+        int token = in[ip++];
+        int literalLength = token >> 4;
+        if (literalLength == 15){
+            int extra;
+            do {
+                if (ip >= srcLen) return -1;
+                extra = in[ip++];
+                literalLength += extra;
+            } while (extra == 255);
+        }
+        if (ip + literalLength > srcLen || op + literalLength > dstCap) return -1;
+        memcpy(out + op, in + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == srcLen) break; // last sequence has no match
+
+        if (ip + 2 > srcLen) return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int matchLength = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15){
+            int extra;
+            do {
+                if (ip >= srcLen) return -1;
+                extra = in[ip++];
+                matchLength += extra;
+            } while (extra == 255);
+        }
+        if (offset == 0 || offset > op || op + matchLength > dstCap) return -1;
+        //byte by byte, the match may overlap what it produces
+        for (int i = 0; i < matchLength; i++, op++) out[op] = out[op - offset];
+    }
+    return op;
+}
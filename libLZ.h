@@ -0,0 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+// worst case output size of lzCompress for srcLen bytes of input
+#define LZ_BOUND(srcLen) ((srcLen) + (srcLen) / 255 + 16)
+
+int lzCompress(const char *src, int srcLen, char *dst, int dstCap);
+
+int lzDecompress(const char *src, int srcLen, char *dst, int dstCap);
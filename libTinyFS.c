@@ -2,10 +2,678 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "libDisk.h"
 #include "libTinyFS.h"
+#include "libLZ.h"
 #include "tinyFS_errno.h"
 
+char *mountedDiskname;
+
+static OpenFileEntry originalFileTable = {-1, "root", NULL, 0};
+OpenFileEntry *openFileTable = &originalFileTable;
+
+//the mounted disk stays open until tfs_unmount
+static int mountedDisk = -1;
+static int mountedBlocks = MAX_BLOCKS; // size of the mounted disk, from the root inode
+
+/* Decompressed chunks of compressed files, keyed by file name so that
+sequential tfs_readByte calls do not re-read and re-decompress extents.
+Entries pinned by tfs_readRef are not reused until released. */
+typedef struct {
+    char filename[9];
+    int chunk;
+    int length;
+    int pins;
+    char data[COMPRESS_CHUNK_SIZE];
+} ChunkCacheEntry;
+
+static ChunkCacheEntry chunkCache[CHUNK_CACHE_ENTRIES];
+static int nextCacheEntry = 0;
+
+/* Blocks handed out by tfs_readRef, read straight from the disk into the
+page. Keyed by file name and extent number within the file, so that like
+the chunk cache they only go stale when the file itself is written. */
+typedef struct {
+    char filename[9];
+    int index; // extent number, -1 for the inode of an inline file
+    int pins;
+    char block[BLOCKSIZE];
+} RefPage;
+
+static RefPage refPages[REF_PAGES];
+
+//staging area for a compressed file, never larger than the disk
+static char chunkStream[MAX_BLOCKS * (BLOCKSIZE - 3)];
+
+/* While tfs_batch runs, blocks of the mounted disk are kept here and only
+written back when the batch ends, so its operations share inode lookups
+and allocator updates and the superblock is written once. */
+static int batchActive = 0;
+static char batchBlocks[MAX_BLOCKS][BLOCKSIZE];
+static unsigned char batchValid[MAX_BLOCKS];
+static unsigned char batchDirty[MAX_BLOCKS];
+
+/* Durability policy of the mounted disk, see tfs_setDurability. Writes
+to it set ‘unsynced’ once they are done and a sync clears it before
+calling syncDisk, so no write is missed by a sync the flusher thread of
+DURABILITY_PERIODIC runs at the same time. */
+static int durability = DURABILITY_NONE;
+static int flushPeriodMs = 0;
+static int unsynced = 0;
+static int flusherRunning = 0;
+static pthread_t flusher;
+static pthread_mutex_t flusherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+
+//marks the mounted disk as having unsynced writes, passing on ‘result’
+static int noteWrite(int disk, int result){
+    if (disk == mountedDisk) __atomic_store_n(&unsynced, 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+//syncs the mounted disk if anything was written to it since it was last synced
+static int syncMounted(void){
+    if (!__atomic_exchange_n(&unsynced, 0, __ATOMIC_ACQ_REL)) return 0;
+    if (syncDisk(mountedDisk) == 0) return 0;
+    __atomic_store_n(&unsynced, 1, __ATOMIC_RELEASE);
+    return WRITE_ERROR;
+}
+
+/* Ends a tfs_* call that may have written, syncing the disk first under
+DURABILITY_SYNC. Calls made by tfs_batch are synced together once the
+batch ends. Returns ‘result’, or WRITE_ERROR if the sync fails. */
+static int commitOperation(int result){
+    if (durability != DURABILITY_SYNC || batchActive || mountedDisk < 0) return result;
+    if (syncMounted() < 0 && result >= 0) return WRITE_ERROR;
+    return result;
+}
+
+//syncs the mounted disk every flushPeriodMs while there are unsynced writes
+static void *flushLoop(void *unused){
+    pthread_mutex_lock(&flusherLock);
+    while (flusherRunning){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flushPeriodMs / 1000;
+        deadline.tv_nsec += (flushPeriodMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusherWake, &flusherLock, &deadline);
+        if (flusherRunning) syncMounted();
+    }
+    pthread_mutex_unlock(&flusherLock);
+    return NULL;
+}
+
+//stops the flusher thread, if there is one, and waits for it to finish
+static void stopFlusher(void){
+    if (!flusherRunning) return;
+    pthread_mutex_lock(&flusherLock);
+    flusherRunning = 0;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&flusherLock);
+    pthread_join(flusher, NULL);
+}
+
+//readBlock for the file system, served from the batch cache while a batch runs
+static int readFsBlock(int disk, int bNum, void *block){
+    if (!batchActive || disk != mountedDisk || bNum < 0 || bNum >= MAX_BLOCKS) return readBlock(disk, bNum, block);
+    if (!batchValid[bNum]){
+        if (readBlock(disk, bNum, batchBlocks[bNum]) < 0) return -1;
+        batchValid[bNum] = 1;
+    }
+    memcpy(block, batchBlocks[bNum], BLOCKSIZE);
+    return 0;
+}
+
+static int writeFsBlock(int disk, int bNum, void *block){
+    if (!batchActive || disk != mountedDisk || bNum < 0 || bNum >= MAX_BLOCKS) return noteWrite(disk, writeBlock(disk, bNum, block));
+    memcpy(batchBlocks[bNum], block, BLOCKSIZE);
+    batchValid[bNum] = 1;
+    batchDirty[bNum] = 1;
+    return 0;
+}
+
+static int readFsBlocks(int disk, int bNum, int count, void *blocks){
+    if (!batchActive || disk != mountedDisk) return readBlocks(disk, bNum, count, blocks);
+    for (int i = 0; i < count; i++){
+        if (readFsBlock(disk, bNum + i, (char *) blocks + i * BLOCKSIZE) < 0) return -1;
+    }
+    return 0;
+}
+
+static int writeFsBlocks(int disk, int bNum, int count, void *blocks){
+    if (!batchActive || disk != mountedDisk) return noteWrite(disk, writeBlocks(disk, bNum, count, blocks));
+    for (int i = 0; i < count; i++){
+        if (writeFsBlock(disk, bNum + i, (char *) blocks + i * BLOCKSIZE) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Drops cached chunks and pages of ‘filename’, or of every file if it is
+NULL. Pinned ones keep their contents for the holder of the ref. */
+static void invalidateFileCache(char *filename){
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++){
+        if (filename == NULL || strcmp(chunkCache[i].filename, filename) == 0) chunkCache[i].filename[0] = '\0';
+    }
+    for (int i = 0; i < REF_PAGES; i++){
+        if (filename == NULL || strcmp(refPages[i].filename, filename) == 0) refPages[i].filename[0] = '\0';
+    }
+}
+
+/* Compresses ‘buffer’ into chunkStream as a sequence of chunks, each with a
+4 byte header holding its raw and stored length (little endian). Chunks
+that do not shrink are stored as is, with both lengths equal. Returns the
+stream length, or -1 if it does not fit on the disk. */
+static int compressChunks(char *buffer, int size){
+    int out = 0;
+    for (int pos = 0; pos < size; pos += COMPRESS_CHUNK_SIZE){
+        int rawLength = (size - pos < COMPRESS_CHUNK_SIZE) ? size - pos : COMPRESS_CHUNK_SIZE;
+        if (out + 4 + rawLength > sizeof(chunkStream)) return -1;
+        int storedLength = lzCompress(buffer + pos, rawLength, chunkStream + out + 4, rawLength - 1);
+        if (storedLength < 0){
+            storedLength = rawLength;
+            memcpy(chunkStream + out + 4, buffer + pos, rawLength);
+        }
+        chunkStream[out] = rawLength & 0xff;
+        chunkStream[out + 1] = rawLength >> 8;
+        chunkStream[out + 2] = storedLength & 0xff;
+        chunkStream[out + 3] = storedLength >> 8;
+        out += 4 + storedLength;
+    }
+    return out;
+}
+
+//reads extents into chunkStream until at least ‘needed’ bytes are buffered
+static int fillChunkStream(int disk, int *buffered, int *extent, int needed){
+    if (needed > sizeof(chunkStream)) return -1;
+    while (*buffered < needed){
+        if (*extent == -1) return -1;
+        FileExtent fileExtent;
+        if (readFsBlock(disk, *extent, &fileExtent) < 0) return -1;
+        memcpy(chunkStream + *buffered, fileExtent.data, BLOCKSIZE - 3);
+        *buffered += BLOCKSIZE - 3;
+        *extent = fileExtent.nextDataBlock;
+    }
+    return 0;
+}
+
+//decompresses chunk number ‘chunk’ of a compressed file into ‘entry’
+static int loadChunk(int disk, Inode *inode, int chunk, ChunkCacheEntry *entry){
+    int buffered = 0;
+    int extent = inode->firstFileExtentPtr;
+    int pos = 0;
+    for (int i = 0; i <= chunk; i++){
+        if (fillChunkStream(disk, &buffered, &extent, pos + 4) < 0) return READ_ERROR;
+        unsigned char *header = (unsigned char *) chunkStream + pos;
+        int rawLength = header[0] | (header[1] << 8);
+        int storedLength = header[2] | (header[3] << 8);
+        if (i < chunk){
+            pos += 4 + storedLength;
+            continue;
+        }
+        if (fillChunkStream(disk, &buffered, &extent, pos + 4 + storedLength) < 0) return READ_ERROR;
+        if (rawLength > COMPRESS_CHUNK_SIZE) return READ_ERROR;
+        if (storedLength == rawLength) memcpy(entry->data, chunkStream + pos + 4, rawLength);
+        else if (lzDecompress(chunkStream + pos + 4, storedLength, entry->data, COMPRESS_CHUNK_SIZE) != rawLength) return READ_ERROR;
+        entry->length = rawLength;
+    }
+    return 0;
+}
+
+//points ‘entry’ at the cached chunk, loading it into an unpinned entry if needed
+static int getChunk(int disk, Inode *inode, char *filename, int chunk, ChunkCacheEntry **entry){
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++){
+        if (chunkCache[i].chunk == chunk && strcmp(chunkCache[i].filename, filename) == 0){
+            *entry = &chunkCache[i];
+            return 0;
+        }
+    }
+    *entry = NULL;
+    for (int tries = 0; *entry == NULL && tries < CHUNK_CACHE_ENTRIES; tries++){
+        if (chunkCache[nextCacheEntry].pins == 0) *entry = &chunkCache[nextCacheEntry];
+        nextCacheEntry = (nextCacheEntry + 1) % CHUNK_CACHE_ENTRIES;
+    }
+    if (*entry == NULL) return TOO_MANY_REFERENCES; // every entry is pinned
+    (*entry)->filename[0] = '\0';
+    if (loadChunk(disk, inode, chunk, *entry) < 0) return READ_ERROR;
+    strcpy((*entry)->filename, filename);
+    (*entry)->chunk = chunk;
+    return 0;
+}
+
+static int readCompressedByte(int disk, Inode *inode, char *filename, int offset, char *buffer){
+    ChunkCacheEntry *entry;
+    int result = getChunk(disk, inode, filename, offset / COMPRESS_CHUNK_SIZE, &entry);
+    if (result < 0) return result;
+    if (offset % COMPRESS_CHUNK_SIZE >= entry->length) return READ_ERROR;
+    *buffer = entry->data[offset % COMPRESS_CHUNK_SIZE];
+    return 0;
+}
+
+//block writes dedup skipped since the file system was mounted
+static int dedupWritesSaved = 0;
+
+/* Hashes a whole block into a 16-bit fingerprint, 0 is never returned so it
+can mark empty index slots. The four 64-bit lanes are independent until the
+final fold, which lets the compiler vectorize the loop. */
+static unsigned short fingerprintBlock(const void *block){
+    const unsigned char *bytes = block;
+    unsigned long long lanes[4] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+                                   0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL};
+    for (int i = 0; i < BLOCKSIZE; i += 32){
+        for (int j = 0; j < 4; j++){
+            unsigned long long word;
+            memcpy(&word, bytes + i + 8 * j, 8);
+            lanes[j] = (lanes[j] ^ word) * 0x100000001b3ULL;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+    unsigned long long hash = lanes[0] ^ (lanes[1] * 31) ^ (lanes[2] * 961) ^ (lanes[3] * 29791);
+    hash ^= hash >> 32;
+    hash ^= hash >> 16;
+    unsigned short fingerprint = hash & 0xffff;
+    return fingerprint ? fingerprint : 1;
+}
+
+/* Reads the superblock and, when dedup is on, the fingerprint index into
+‘indexBlock’. *index is left NULL when dedup is off. */
+static int readAllocator(int disk, Superblock *superblock, DedupIndex *indexBlock, DedupIndex **index){
+    *index = NULL;
+    if (readFsBlock(disk, 0, superblock) < 0) return READ_ERROR;
+    if (superblock->dedupIndexPtr == -1) return 0;
+    if (readFsBlock(disk, superblock->dedupIndexPtr, indexBlock) < 0) return READ_ERROR;
+    *index = indexBlock;
+    return 0;
+}
+
+//free blocks are only recorded in the superblock's freeMap, their contents are never read
+static int isFreeBlock(Superblock *superblock, int block){
+    return (superblock->freeMap[block / 8] >> (block % 8)) & 1;
+}
+
+static void setFreeBlock(Superblock *superblock, int block, int free){
+    if (free) superblock->freeMap[block / 8] |= 1 << (block % 8);
+    else superblock->freeMap[block / 8] &= ~(1 << (block % 8));
+}
+
+//blocks freed since the last writeAllocator, whose host storage is still to be released
+static unsigned char trimPending[MAX_BLOCKS / 8];
+
+/* Releases the host storage of every run of free blocks that contains a
+block marked in ‘blocks’. Whole runs are trimmed so that blocks freed by
+separate calls still add up to releasable host units. */
+static void trimFreeBlocks(int disk, Superblock *superblock, unsigned char *blocks){
+    int start = -1;
+    int marked = 0;
+    for (int block = 0; block <= MAX_BLOCKS; block++){
+        if (block < MAX_BLOCKS && isFreeBlock(superblock, block)){
+            if (start == -1) start = block;
+            if ((blocks[block / 8] >> (block % 8)) & 1) marked = 1;
+            continue;
+        }
+        if (start != -1 && marked) trimBlocks(disk, start, block - start);
+        start = -1;
+        marked = 0;
+    }
+}
+
+static int writeAllocator(int disk, Superblock *superblock, DedupIndex *index){
+    if (writeFsBlock(disk, 0, superblock) < 0) return WRITE_ERROR;
+    if (index != NULL && writeFsBlock(disk, superblock->dedupIndexPtr, index) < 0) return WRITE_ERROR;
+    //freed blocks are only trimmed once the superblock says they are free,
+    //in a batch that is when it ends
+    if (batchActive) return 0;
+    trimFreeBlocks(disk, superblock, trimPending);
+    memset(trimPending, 0, sizeof(trimPending));
+    return 0;
+}
+
+//returns the lowest free block without taking it
+static int peekFreeBlock(Superblock *superblock){
+    for (int i = 0; i < MAX_BLOCKS / 8; i++){
+        if (superblock->freeMap[i] == 0) continue;
+        return i * 8 + __builtin_ctz(superblock->freeMap[i]);
+    }
+    return OUT_OF_BLOCKS;
+}
+
+static void takeFreeBlock(Superblock *superblock, int block){
+    setFreeBlock(superblock, block, 0);
+    trimPending[block / 8] &= ~(1 << (block % 8));
+}
+
+//takes the lowest free block, so files fill the disk from the front
+static int popFreeBlock(Superblock *superblock){
+    int block = peekFreeBlock(superblock);
+    if (block < 0) return block;
+    takeFreeBlock(superblock, block);
+    return block;
+}
+
+static int countFreeBlocks(Superblock *superblock){
+    int count = 0;
+    for (int i = 0; i < MAX_BLOCKS / 8; i++) count += __builtin_popcount(superblock->freeMap[i]);
+    return count;
+}
+
+//returns the first block of the lowest run of ‘count’ free blocks, or -1
+static int findFreeRun(Superblock *superblock, int count){
+    int start = 0;
+    for (int block = 0; block < MAX_BLOCKS; block++){
+        if (!isFreeBlock(superblock, block)) start = block + 1;
+        else if (block - start + 1 == count) return start;
+    }
+    return -1;
+}
+
+static void pushFreeBlock(Superblock *superblock, int block){
+    setFreeBlock(superblock, block, 1);
+    trimPending[block / 8] |= 1 << (block % 8);
+}
+
+//extents of a chain being walked, read a run at a time
+static FileExtent chainRun[MAX_BLOCKS];
+
+/* Returns extent ‘block’ of a chain from chainRun. Only the next pointers
+are needed to walk a chain, so it is read as if it were laid out in
+consecutive blocks, ‘length’ of them from ‘block’ on, and read again only
+where it jumps out of the run read last (*runStart, *runLength). A wrong
+‘length’ only costs reads. NULL if the block cannot be read. */
+static FileExtent *readChainExtent(int disk, int block, int length, int *runStart, int *runLength){
+    if (block >= *runStart && block < *runStart + *runLength) return &chainRun[block - *runStart];
+    *runStart = block;
+    *runLength = (length > 1) ? length : 1;
+    int blocks = (disk == mountedDisk) ? mountedBlocks : MAX_BLOCKS;
+    if (*runLength > blocks - block) *runLength = (block < blocks) ? blocks - block : 1;
+    //a run past the end of the disk fails, the chain itself cannot
+    if (readFsBlocks(disk, block, *runLength, chainRun) < 0){
+        *runLength = 1;
+        if (readFsBlock(disk, block, chainRun) < 0){
+            *runLength = 0;
+            return NULL;
+        }
+    }
+    return chainRun;
+}
+
+/* Drops one reference to the extent chain starting at ‘first’, which is
+expected to be ‘length’ blocks long (the inode's fileSize). Blocks no one
+else references go back in the free map and out of the dedup index. The
+walk stops at the first shared block, the rest of the chain is still in
+use from there. A contiguous file is released with one read and no
+writes. The caller writes back the superblock and index. */
+static int releaseExtents(int disk, Superblock *superblock, DedupIndex *index, int first, int length){
+    int runStart = -1;
+    int runLength = 0;
+    int block = first;
+    while (block != -1){
+        if (block < 2 || block >= MAX_BLOCKS) return FS_INCONSISTENT;
+        if (superblock->refCount[block] > 0){
+            superblock->refCount[block]--;
+            return 0;
+        }
+        FileExtent *extent = readChainExtent(disk, block, length--, &runStart, &runLength);
+        if (extent == NULL) return READ_ERROR;
+        pushFreeBlock(superblock, block);
+        if (index != NULL) index->fingerprint[block - 2] = 0;
+        block = extent->nextDataBlock;
+    }
+    return 0;
+}
+
+//returns an indexed block with exactly the contents of ‘extent’, or -1
+static int findDuplicate(int disk, Superblock *superblock, DedupIndex *index, FileExtent *extent, unsigned short fingerprint){
+    for (int i = 0; i < MAX_BLOCKS - 2; i++){
+        if (index->fingerprint[i] != fingerprint) continue;
+        if (superblock->refCount[i + 2] == UCHAR_MAX) continue;
+        FileExtent candidate;
+        if (readFsBlock(disk, i + 2, &candidate) < 0) continue;
+        if (memcmp(&candidate, extent, BLOCKSIZE) == 0) return i + 2;
+    }
+    return -1;
+}
+
+/* Lays out ‘size’ bytes of ‘data’ as an extent chain, last block first, so
+each block's contents (next pointer included) are known before it is
+placed. A block identical to one already on disk is shared by taking a
+reference to it instead of being written. Since the next pointer is part
+of the contents this shares whole chain tails between files. Returns the
+first block of the chain or an error code. */
+static int writeDedupExtents(int disk, Superblock *superblock, DedupIndex *index, char *data, int size){
+    int nBlocks = (size + BLOCKSIZE - 4) / (BLOCKSIZE - 3);
+    int next = -1;
+    for (int i = nBlocks - 1; i >= 0; i--){
+        FileExtent extent;
+        memset(&extent, 0, sizeof(FileExtent));
+        extent.blockType = 4;
+        extent.magicNumber = MAGIC_NUMBER;
+        extent.nextDataBlock = next;
+        int length = size - i * (BLOCKSIZE - 3);
+        if (length > BLOCKSIZE - 3) length = BLOCKSIZE - 3;
+        memcpy(extent.data, data + i * (BLOCKSIZE - 3), length);
+
+        unsigned short fingerprint = fingerprintBlock(&extent);
+        int shared = findDuplicate(disk, superblock, index, &extent, fingerprint);
+        if (shared != -1){
+            //the shared block already references the rest of the chain, so
+            //the reference taken on the next block is not needed
+            if (next != -1) superblock->refCount[next]--;
+            superblock->refCount[shared]++;
+            dedupWritesSaved++;
+            next = shared;
+            continue;
+        }
+
+        int block = popFreeBlock(superblock);
+        int result = block;
+        if (block >= 0 && writeFsBlock(disk, block, &extent) < 0){
+            pushFreeBlock(superblock, block);
+            result = WRITE_ERROR;
+        }
+        if (result < 0){
+            releaseExtents(disk, superblock, index, next, nBlocks - 1 - i);
+            return result;
+        }
+        index->fingerprint[block - 2] = fingerprint;
+        next = block;
+    }
+    return next;
+}
+
+//staging area for the extents written by writeExtents and rewriteExtents
+static FileExtent extentRun[MAX_BLOCKS];
+
+//fills extentRun with ‘size’ bytes of ‘data’ chained through ‘count’ blocks, zeroed past the data
+static void fillExtentRun(int *blocks, int count, char *data, int size){
+    for (int i = 0; i < count; i++){
+        FileExtent *extent = &extentRun[i];
+        extent->blockType = 4;
+        extent->magicNumber = MAGIC_NUMBER;
+        extent->nextDataBlock = (i < count - 1) ? blocks[i + 1] : -1;
+        int length = size - i * (BLOCKSIZE - 3);
+        if (length > BLOCKSIZE - 3) length = BLOCKSIZE - 3;
+        if (length < 0) length = 0;
+        memcpy(extent->data, data + i * (BLOCKSIZE - 3), length);
+        memset(extent->data + length, 0, BLOCKSIZE - 3 - length);
+    }
+}
+
+//writes extentRun to ‘blocks’, each run of consecutive blocks in one write
+static int writeExtentRun(int disk, int *blocks, int count){
+    int start = 0;
+    for (int i = 1; i <= count; i++){
+        if (i < count && blocks[i] == blocks[i - 1] + 1) continue;
+        if (writeFsBlocks(disk, blocks[start], i - start, &extentRun[start]) < 0) return WRITE_ERROR;
+        start = i;
+    }
+    return 0;
+}
+
+/* Lays out ‘size’ bytes of ‘data’ as a new extent chain of at least
+‘capacity’ blocks, the ones past the data being reserved for the file to
+grow into. Every block is taken from the free map before anything is
+written, lowest first, so the chain is as contiguous as free space allows
+and each run of consecutive blocks goes to the disk in one write. A chain
+with reserved blocks is put in one run of free blocks if the disk has one.
+Nothing is taken if the chain does not fit. Returns the first block of
+the chain or an error code. */
+static int writeExtents(int disk, Superblock *superblock, char *data, int size, int capacity){
+    int nBlocks = (size + BLOCKSIZE - 4) / (BLOCKSIZE - 3);
+    if (capacity < nBlocks) capacity = nBlocks;
+    if (capacity > countFreeBlocks(superblock)) return OUT_OF_BLOCKS;
+
+    int blocks[MAX_BLOCKS];
+    int run = (capacity > nBlocks) ? findFreeRun(superblock, capacity) : -1;
+    for (int i = 0; i < capacity; i++){
+        if (run == -1) blocks[i] = popFreeBlock(superblock);
+        else {
+            blocks[i] = run + i;
+            takeFreeBlock(superblock, blocks[i]);
+        }
+    }
+    fillExtentRun(blocks, capacity, data, size);
+    if (writeExtentRun(disk, blocks, capacity) < 0){
+        for (int i = 0; i < capacity; i++) pushFreeBlock(superblock, blocks[i]);
+        return WRITE_ERROR;
+    }
+    return (capacity > 0) ? blocks[0] : -1;
+}
+
+/* Writes ‘size’ bytes of ‘data’ over the extent chain starting at ‘first’,
+‘length’ blocks long, keeping its first ‘capacity’ blocks and freeing the
+rest. Only done if the chain has that many blocks and no other file or
+snapshot shares any of them. Returns the number of blocks kept, 0 if the
+chain cannot be reused, or an error code. */
+static int rewriteExtents(int disk, Superblock *superblock, DedupIndex *index, int first, int length, char *data, int size, int capacity){
+    int blocks[MAX_BLOCKS];
+    int count = 0;
+    int runStart = -1;
+    int runLength = 0;
+    int block = first;
+    while (block != -1){
+        if (block < 2 || block >= MAX_BLOCKS || count == MAX_BLOCKS) return FS_INCONSISTENT;
+        if (superblock->refCount[block] > 0) return 0; // shared, rewriting it would change other files
+        FileExtent *extent = readChainExtent(disk, block, length - count, &runStart, &runLength);
+        if (extent == NULL) return READ_ERROR;
+        blocks[count++] = block;
+        block = extent->nextDataBlock;
+    }
+    if (count == 0 || count < capacity) return 0;
+
+    fillExtentRun(blocks, capacity, data, size);
+    if (writeExtentRun(disk, blocks, capacity) < 0) return WRITE_ERROR;
+    for (int i = capacity; i < count; i++) pushFreeBlock(superblock, blocks[i]);
+    //the new contents are not fingerprinted, they are not shared either
+    for (int i = 0; index != NULL && i < count; i++) index->fingerprint[blocks[i] - 2] = 0;
+    return capacity;
+}
+
+/* Gives back the headroom of every file but the one whose inode is at
+‘skip’: blocks past its data that it kept only to grow into. Reserved,
+compressed and inline files are left alone, as is any chain another file
+or a snapshot shares. Each cut file ends at the last block its data
+needs. Writes back the allocator. Returns the number of blocks freed or
+an error code. */
+static int releaseHeadroom(int disk, int skip){
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(disk, &superblock, &indexBlock, &index);
+    if (result < 0) return result;
+    Inode inode;
+    if (readFsBlock(disk, 1, &inode) < 0) return READ_ERROR;
+    int freed = 0;
+    while (inode.nextInodePtr != -1){
+        int inodeBlock = inode.nextInodePtr;
+        if (readFsBlock(disk, inodeBlock, &inode) < 0) return READ_ERROR;
+        if (inodeBlock == skip || (inode.flags & (INODE_INLINE | INODE_COMPRESSED | INODE_RESERVED))) continue;
+        int needed = (inode.dataSize + BLOCKSIZE - 4) / (BLOCKSIZE - 3);
+        int length = (unsigned char) inode.fileSize;
+        if (length <= needed) continue;
+
+        int blocks[MAX_BLOCKS];
+        int count = 0;
+        int runStart = -1;
+        int runLength = 0;
+        int block = inode.firstFileExtentPtr;
+        while (block != -1 && count < MAX_BLOCKS){
+            if (block < 2 || block >= MAX_BLOCKS) return FS_INCONSISTENT;
+            if (superblock.refCount[block] > 0) break; // shared, other files still use the tail
+            FileExtent *extent = readChainExtent(disk, block, length - count, &runStart, &runLength);
+            if (extent == NULL) return READ_ERROR;
+            blocks[count++] = block;
+            block = extent->nextDataBlock;
+        }
+        if (block != -1 || count != length) continue;
+
+        //the chain is cut before the allocator is written, a crash only leaks the tail
+        if (needed > 0){
+            FileExtent last;
+            if (readFsBlock(disk, blocks[needed - 1], &last) < 0) return READ_ERROR;
+            last.nextDataBlock = -1;
+            if (writeFsBlock(disk, blocks[needed - 1], &last) < 0) return WRITE_ERROR;
+        }
+        else inode.firstFileExtentPtr = -1;
+        inode.fileSize = needed;
+        if (writeFsBlock(disk, inodeBlock, &inode) < 0) return WRITE_ERROR;
+        for (int i = needed; i < count; i++){
+            pushFreeBlock(&superblock, blocks[i]);
+            if (index != NULL) index->fingerprint[blocks[i] - 2] = 0;
+        }
+        freed += count - needed;
+        invalidateFileCache((char *) inode.fileName);
+    }
+    if (freed > 0 && writeAllocator(disk, &superblock, index) < 0) return WRITE_ERROR;
+    return freed;
+}
+
+//finds the inode of file ‘name’, returns its block or -1
+static int findInodeByName(int disk, char *name, Inode *inode){
+    if (readFsBlock(disk, 1, inode) < 0) return -1;
+    while (inode->nextInodePtr != -1){
+        int block = inode->nextInodePtr;
+        if (readFsBlock(disk, block, inode) < 0) return -1; // Bad inode ptr
+        if (strcmp((char *) inode->fileName, name) == 0) return block;
+    }
+    return -1;
+}
+
+/* Writes a copy of ‘inode’ to a newly allocated block, linked to ‘next’.
+The copy shares the extents of the original by taking a reference on the
+first one. Returns the new block or an error code. */
+static int copyInode(int disk, Superblock *superblock, Inode *inode, int next){
+    int first = inode->firstFileExtentPtr;
+    if (first != -1 && superblock->refCount[first] == UCHAR_MAX) return TOO_MANY_REFERENCES;
+    int block = popFreeBlock(superblock);
+    if (block < 0) return block;
+    Inode copy = *inode;
+    copy.filePointer = block;
+    copy.nextInodePtr = next;
+    if (writeFsBlock(disk, block, &copy) < 0) return WRITE_ERROR;
+    if (first != -1) superblock->refCount[first]++;
+    return block;
+}
+
+//frees every inode on the chain starting at ‘first’, and their extents
+static int releaseInodeChain(int disk, Superblock *superblock, DedupIndex *index, int first){
+    int block = first;
+    while (block != -1){
+        Inode inode;
+        if (readFsBlock(disk, block, &inode) < 0) return READ_ERROR;
+        int result = releaseExtents(disk, superblock, index, inode.firstFileExtentPtr, inode.fileSize);
+        if (result < 0) return result;
+        pushFreeBlock(superblock, block);
+        block = inode.nextInodePtr;
+    }
+    return 0;
+}
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
@@ -14,14 +682,19 @@ file to be a mountable disk. This includes initializing all data to 0x00,
 setting magic numbers, initializing and writing the superblock and
 inodes, etc. Must return a specified success/error code. */
 int tfs_mkfs(char *filename, int nBytes){
+    if (nBytes > MAX_BLOCKS * BLOCKSIZE) return INVALID_DISK; // block pointers cannot reach past MAX_BLOCKS
     int disk = openDisk(filename, nBytes);
     if (disk < 0) return INVALID_DISK; // Error opening disk
 
     Superblock superblock;
+    memset(&superblock, 0, sizeof(Superblock));
     superblock.blockType = 1;
     superblock.magicNumber = MAGIC_NUMBER;
     superblock.rootInode = 1;
-    superblock.freeBlockPtr = 2;
+    superblock.dedupIndexPtr = -1;
+    superblock.snapshotInodePtr = -1;
+    memcpy(superblock.formatVersion, FORMAT_VERSION, sizeof(superblock.formatVersion));
+    for (int i = 2; i < nBytes / BLOCKSIZE && i < MAX_BLOCKS; i++) setFreeBlock(&superblock, i, 1);
 
     Inode rootInode;
     rootInode.blockType = 2;
@@ -32,60 +705,100 @@ int tfs_mkfs(char *filename, int nBytes){
     rootInode.filePointer = 1;
     rootInode.nextInodePtr = -1;
     rootInode.firstFileExtentPtr = -1;
+    rootInode.flags = 0;
+    rootInode.dataSize = 0;
 
     // Write superblock and root inode to disk
     if (writeBlock(disk, 0, &superblock) < 0) return WRITE_ERROR;
     if (writeBlock(disk, 1, &rootInode) < 0) return WRITE_ERROR;
 
-    // Initialize free blocks
-    FreeBlock freeBlock;
-    freeBlock.blockType = 3;
-    freeBlock.magicNumber = MAGIC_NUMBER;
-    freeBlock.nextFreeBlock = 3;
-    for (int i = 2; i < nBytes / BLOCKSIZE; i++){
-        if (writeBlock(disk, i, &freeBlock) < 0) return WRITE_ERROR;
-        if (i < nBytes / BLOCKSIZE - 1) freeBlock.nextFreeBlock = i + 1;
-        else if (i == nBytes / BLOCKSIZE - 1) freeBlock.nextFreeBlock = -1;
-    }
+    // Free blocks are only in the free map, an old image's data is released
+    trimFreeBlocks(disk, &superblock, superblock.freeMap);
 
+    closeDisk(disk);
     return 0;
 
 }
 
 
-/* tfs_mount(char *diskname) “mounts” a TinyFS file system located within
-‘diskname’. As part of the mount operation, tfs_mount should verify the file
-system is the correct type. In tinyFS, only one file system may be
-mounted at a time.  Must return a specified success/error code. */
-int tfs_mount(char *diskname){
-    if (mountedDiskname != NULL) tfs_unmount(); // File system already mounted
-    int disk = openDisk(diskname, 0);
-    if (disk < 0) return INVALID_DISK; // Error opening disk, add error message
+//checks that ‘superblock’ starts a file system in the current format
+static int isCurrentFormat(Superblock *superblock){
+    if (superblock->blockType != 1 || superblock->magicNumber != MAGIC_NUMBER) return 0;
+    return memcmp(superblock->formatVersion, FORMAT_VERSION, sizeof(superblock->formatVersion)) == 0;
+}
 
+//checks that ‘disk’ holds a TinyFS file system
+static int checkDisk(int disk){
     char buffer[BLOCKSIZE];
-    if (readBlock(disk, 0, buffer) < 0) return -1;
-    if (buffer[0] != 1) return NOT_TINYFS_FORMAT; // Incorrect block type
-    if (buffer[1] != MAGIC_NUMBER) return NOT_TINYFS_FORMAT; // Incorrect magic number
+    Superblock superblock;
+    if (readBlock(disk, 0, &superblock) < 0) return READ_ERROR;
+    if (!isCurrentFormat(&superblock)) return NOT_TINYFS_FORMAT; // Incorrect block type, magic number or version
 
     //get file size
     char rootInode[BLOCKSIZE];
     if (readBlock(disk, 1, rootInode) < 0) return READ_ERROR;
-    char fileSize = rootInode[11];
+    unsigned char fileSize = rootInode[11];
 
-    //check that every block has correct magic number
+    //check that every block in use has correct magic number
     for (int i = 1; i < fileSize; i++){
+        if (isFreeBlock(&superblock, i)) continue; // free blocks may be holes
         if (readBlock(disk, i, buffer) < 0) return READ_ERROR;
         if (buffer[1] != MAGIC_NUMBER) return NOT_TINYFS_FORMAT; // Incorrect magic number
     }
-    
+    return 0;
+}
+
+/* tfs_mount(char *diskname) “mounts” a TinyFS file system located within
+‘diskname’. As part of the mount operation, tfs_mount should verify the file
+system is the correct type. In tinyFS, only one file system may be
+mounted at a time.  Must return a specified success/error code. */
+int tfs_mount(char *diskname){
+    if (mountedDiskname != NULL) tfs_unmount(); // File system already mounted
+    invalidateFileCache(NULL);
+    dedupWritesSaved = 0;
+    memset(trimPending, 0, sizeof(trimPending));
+    int disk = openDisk(diskname, 0);
+    if (disk < 0) return INVALID_DISK; // Error opening disk, add error message
+
+    int result = checkDisk(disk);
+    if (result < 0){
+        closeDisk(disk);
+        return result;
+    }
+
+    Inode rootInode;
+    if (readBlock(disk, 1, &rootInode) < 0){
+        closeDisk(disk);
+        return READ_ERROR;
+    }
+    mountedBlocks = (unsigned char) rootInode.fileSize;
+    if (mountedBlocks > MAX_BLOCKS) mountedBlocks = MAX_BLOCKS;
+
     mountedDiskname = diskname;
+    mountedDisk = disk;
     return 0;
 
 }
 
+/* tfs_unmount(void) “unmounts” the currently mounted file system, closing
+its disk even if the final sync fails. Returns success, or WRITE_ERROR if
+writes made before the unmount could not be synced. */
 int tfs_unmount(void){
 
+    //every policy but DURABILITY_NONE leaves nothing unsynced on unmount
+    stopFlusher();
+    int result = 0;
+    if (mountedDisk >= 0 && durability != DURABILITY_NONE) result = syncMounted();
+    durability = DURABILITY_NONE;
+    __atomic_store_n(&unsynced, 0, __ATOMIC_RELEASE);
+    if (mountedDisk >= 0) closeDisk(mountedDisk);
+    mountedDisk = -1;
+    mountedBlocks = MAX_BLOCKS;
     mountedDiskname = NULL;
+    invalidateFileCache(NULL);
+    //refs from tfs_readRef end with the mount
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) chunkCache[i].pins = 0;
+    for (int i = 0; i < REF_PAGES; i++) refPages[i].pins = 0;
 
     // clear the open file table
     OpenFileEntry *tempEntry = openFileTable;
@@ -95,7 +808,7 @@ int tfs_unmount(void){
         tempEntry = nextEntry;
     }
     openFileTable = NULL;
-    return 0;
+    return result;
 
 }
 
@@ -108,15 +821,16 @@ fileDescriptor tfs_openFile(char *name){
 
     if (mountedDiskname == NULL) return NO_FS_MOUNTED; // No file system mounted
 
-    int mountedFD = openDisk(mountedDiskname, 0);
+    int mountedFD = mountedDisk;
     fileDescriptor nextOpenTableFD = mountedFD + 1;
+    OpenFileEntry *openEntry = NULL;
     //check if already in open table
     if (openFileTable != NULL) {
         OpenFileEntry *tempEntry = openFileTable; 
         while (tempEntry != NULL) { 
             if (strcmp(tempEntry->filename, name) == 0) { 
-                // File already exists in table, return file descriptor
-                return tempEntry->fileDescriptor;
+                openEntry = tempEntry;
+                break;
             }
             tempEntry = tempEntry->nextEntry; 
             nextOpenTableFD++;
@@ -125,34 +839,34 @@ fileDescriptor tfs_openFile(char *name){
 
     //check if inode with name already exists
     Inode rootInode;
-    if (readBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
-    Inode tempInode = rootInode;
-    while (tempInode.nextInodePtr != -1){
-        if (strcmp(tempInode.fileName, name) == 0){
-            //file already exists
-            //create new open file entry
-            OpenFileEntry *newEntry = malloc(sizeof(OpenFileEntry));
-            newEntry->fileDescriptor = nextOpenTableFD;
-            strcpy(newEntry->filename, name);
-            newEntry->nextEntry = openFileTable;
-            openFileTable = newEntry;
-            
-            //return file descriptor
-            return nextOpenTableFD;
-        }
-        if (readBlock(mountedFD, tempInode.nextInodePtr, &tempInode) < 0) return READ_ERROR; // Bad inode ptr
+    if (readFsBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
+    Inode tempInode;
+    if (openEntry != NULL && findInodeByName(mountedFD, name, &tempInode) != -1){
+        // File already exists in table, return file descriptor
+        return openEntry->fileDescriptor;
+    }
+    //a deleted file keeps its descriptor, the file is made again below
+    if (openEntry == NULL && findInodeByName(mountedFD, name, &tempInode) != -1){
+        //file already exists
+        //create new open file entry
+        OpenFileEntry *newEntry = malloc(sizeof(OpenFileEntry));
+        newEntry->fileDescriptor = nextOpenTableFD;
+        newEntry->offset = 0;
+        strcpy(newEntry->filename, name);
+        newEntry->nextEntry = openFileTable;
+        openFileTable = newEntry;
+
+        //return file descriptor
+        return nextOpenTableFD;
     }
     
     //if not found, create new inode (make sure there is enough space for new inode)
     Superblock superblock;
     Inode newInode;
-    FreeBlock newInodeBlockInfo;
-    if (readBlock(mountedFD, 0, &superblock) < 0) return READ_ERROR;
-    if (superblock.freeBlockPtr == -1) return -1; // No free blocks
-    char newInodeBlock = superblock.freeBlockPtr;
-    if (readBlock(mountedFD, newInodeBlock, &newInodeBlockInfo) < 0) return READ_ERROR;
-    superblock.freeBlockPtr = newInodeBlockInfo.nextFreeBlock;
-    if (writeBlock(mountedFD, 0, &superblock) < 0) return WRITE_ERROR;
+    if (readFsBlock(mountedFD, 0, &superblock) < 0) return READ_ERROR;
+    int newInodeBlock = popFreeBlock(&superblock);
+    if (newInodeBlock < 0) return OUT_OF_BLOCKS; // No free blocks
+    if (writeFsBlock(mountedFD, 0, &superblock) < 0) return WRITE_ERROR;
     newInode.blockType = 2;
     newInode.magicNumber = MAGIC_NUMBER;
     strcpy(newInode.fileName, name);
@@ -161,20 +875,28 @@ fileDescriptor tfs_openFile(char *name){
     newInode.filePointer = newInodeBlock;
     newInode.nextInodePtr = -1;
     newInode.firstFileExtentPtr = -1;
-    if (writeBlock(mountedFD, newInodeBlock, &newInode) < 0) return WRITE_ERROR;
+    newInode.flags = 0;
+    newInode.dataSize = 0;
+    if (writeFsBlock(mountedFD, newInodeBlock, &newInode) < 0) return WRITE_ERROR;
 
-    //update root inode to point to new inode
+    //update last inode to point to new inode
     Inode tempInode2 = rootInode;
     int prevInodeBlock = 1;
     while (tempInode2.nextInodePtr != -1){
-        if (readBlock(mountedFD, tempInode2.nextInodePtr, &tempInode2) < 0) return READ_ERROR; // Bad inode ptr
+        prevInodeBlock = tempInode2.nextInodePtr;
+        if (readFsBlock(mountedFD, tempInode2.nextInodePtr, &tempInode2) < 0) return READ_ERROR; // Bad inode ptr
     }
     tempInode2.nextInodePtr = newInodeBlock;
-    if (writeBlock(mountedFD, tempInode.filePointer, &tempInode2) < 0) return WRITE_ERROR;
+    if (writeFsBlock(mountedFD, prevInodeBlock, &tempInode2) < 0) return WRITE_ERROR;
 
 
     
 
+    if (openEntry != NULL){
+        openEntry->offset = 0;
+        return commitOperation(openEntry->fileDescriptor);
+    }
+
     //create new open file entry
     OpenFileEntry *newEntry = malloc(sizeof(OpenFileEntry));
     newEntry->fileDescriptor = nextOpenTableFD;
@@ -184,11 +906,12 @@ fileDescriptor tfs_openFile(char *name){
     openFileTable = newEntry;
 
     //return file descriptor
-    return nextOpenTableFD;
+    return commitOperation(nextOpenTableFD);
 
 }
 
 int tfs_closeFile(fileDescriptor FD) {
+    if (durability == DURABILITY_CLOSE && mountedDisk >= 0 && syncMounted() < 0) return WRITE_ERROR;
     OpenFileEntry *prev_entry = openFileTable;
     OpenFileEntry *current_entry = openFileTable->nextEntry;
     if (prev_entry->fileDescriptor == FD) {
@@ -213,15 +936,20 @@ int tfs_closeFile(fileDescriptor FD) {
 }
 
 
-/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire
-file’s content, to the file system. Previous content (if any) will be 
-completely lost. Sets the file pointer to 0 (the start of file) when
-done. Returns success/error codes. */
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
+/* tfs_writeFile, which with ‘reserve’ >= 0 also sets the number of
+blocks reserved for the file, 0 dropping its reservation. A file with a
+reservation keeps that many blocks even when its content needs fewer, and
+is rewritten in place when its content fits them. One that outgrows them,
+and any uncompressed file that grows while dedup is off, gets
+1/GROWTH_RESERVE of its size again as headroom if the disk has room for
+it. A write the free blocks cannot hold first takes back the headroom of
+the other files. */
+static int writeFileContent(fileDescriptor FD, char *buffer, int size, int reserve){
     if (mountedDiskname == NULL) return NO_FS_MOUNTED; // No file system mounted
     if (FD < 0) return INVALID_FD; // Invalid file descriptor
+    if (size > USHRT_MAX) return FILE_TOO_LARGE; // dataSize is 16 bits
 
-    int mountedFD = openDisk(mountedDiskname, 0);
+    int mountedFD = mountedDisk;
     OpenFileEntry *tempEntry = openFileTable;
     while (tempEntry != NULL) {
         if (tempEntry->fileDescriptor == FD) {
@@ -229,88 +957,121 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
             // File found in open file table
             char filename[9];
             strcpy(filename, tempEntry->filename);
+            invalidateFileCache(filename);
 
             //find file inode
             Inode rootInode;
-            if (readBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
+            if (readFsBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
             Inode fileInode = rootInode;
             while (fileInode.nextInodePtr != -1){
-                if (readBlock(mountedFD, fileInode.nextInodePtr, &fileInode) < 0) return READ_ERROR; // Bad inode ptr
+                if (readFsBlock(mountedFD, fileInode.nextInodePtr, &fileInode) < 0) return READ_ERROR; // Bad inode ptr
               
                 if (strcmp(fileInode.fileName, filename) == 0){
                     //file inode found
-                    //clear file extent blocks if any exist
-                    Inode tempInode = fileInode;
-                    FreeBlock replacementBlock;
-                    replacementBlock.blockType = 4;
-                    replacementBlock.magicNumber = MAGIC_NUMBER;
-                    int updateFreeBlockList = 0;
-                    while (tempInode.firstFileExtentPtr != -1){
-                        updateFreeBlockList = 1;
-                        FileExtent targetFileExtent;
-                        int targetBlock = tempInode.firstFileExtentPtr;
-                        if (readBlock(mountedFD, tempInode.firstFileExtentPtr, &targetFileExtent) < 0) return READ_ERROR;
-                        replacementBlock.nextFreeBlock = tempInode.firstFileExtentPtr;
-                        tempInode.firstFileExtentPtr = targetFileExtent.nextDataBlock;
-                        if (writeBlock(mountedFD, targetBlock, &replacementBlock) < 0) return WRITE_ERROR;
+                    Superblock superblock;
+                    DedupIndex indexBlock;
+                    DedupIndex *index;
+                    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+                    if (result < 0) return result;
+                    int first = fileInode.firstFileExtentPtr;
+                    int length = (fileInode.flags & INODE_INLINE) ? 0 : (unsigned char) fileInode.fileSize;
+                    //compressed files get none, releaseHeadroom cannot tell what their stream needs
+                    int growing = length > 0 && size >= fileInode.dataSize && index == NULL && !(fileInode.flags & INODE_COMPRESS);
+                    if (reserve > 0) fileInode.flags |= INODE_RESERVED;
+                    else if (reserve == 0) fileInode.flags &= ~INODE_RESERVED;
+                    int reserved = fileInode.flags & INODE_RESERVED;
+                    fileInode.firstFileExtentPtr = -1;
+
+                    //small files are kept inline in the inode
+                    if (size <= INLINE_DATA_SIZE && !reserved){
+                        //release its extents, shared blocks only lose a reference
+                        result = releaseExtents(mountedFD, &superblock, index, first, length);
+                        if (result < 0) return result;
+                        memset(fileInode.inlineData, 0, INLINE_DATA_SIZE);
+                        memcpy(fileInode.inlineData, buffer, size);
+                        fileInode.flags |= INODE_INLINE;
+                        fileInode.flags &= ~INODE_COMPRESSED;
+                        fileInode.fileSize = 0;
+                        fileInode.dataSize = size;
+                        if (writeFsBlock(mountedFD, fileInode.filePointer, &fileInode) < 0) return WRITE_ERROR;
+                        return writeAllocator(mountedFD, &superblock, index);
+                    }
+                    fileInode.flags &= ~(INODE_INLINE | INODE_COMPRESSED);
+
+                    //compressed files lay out a chunk stream instead of the buffer
+                    char *extentData = buffer;
+                    int extentDataSize = size;
+                    if (fileInode.flags & INODE_COMPRESS){
+                        extentDataSize = compressChunks(buffer, size);
+                        extentData = chunkStream;
+                        fileInode.flags |= INODE_COMPRESSED;
                     }
 
-                    //link replacement blocks to free block list
-                    if (updateFreeBlockList){
-                        Superblock superblock;
-                        if (readBlock(mountedFD, 0, &superblock) < 0) return READ_ERROR;
-                        replacementBlock.nextFreeBlock = superblock.freeBlockPtr;
-                        superblock.freeBlockPtr = fileInode.firstFileExtentPtr;
-                        if (writeBlock(mountedFD, 0, &superblock) < 0) return WRITE_ERROR;
+                    //how many blocks the file keeps, its reservation or what
+                    //a growing file already has
+                    int needed = (extentDataSize + BLOCKSIZE - 4) / (BLOCKSIZE - 3);
+                    int capacity = needed;
+                    if (reserve > capacity) capacity = reserve;
+                    else if (reserve < 0 && (reserved || growing) && length > capacity) capacity = length;
 
+                    //a reserved file, or one whose blocks are its own with dedup off,
+                    //is rewritten where it is if it fits. A new reservation is laid out afresh
+                    int kept = 0;
+                    if (extentDataSize >= 0 && reserve < 0 && (reserved || index == NULL) && first != -1){
+                        kept = rewriteExtents(mountedFD, &superblock, index, first, length, extentData, extentDataSize, capacity);
+                        if (kept < 0) return kept;
+                    }
+                    if (kept > 0){
+                        fileInode.firstFileExtentPtr = first;
+                        fileInode.fileSize = kept;
+                        fileInode.dataSize = size;
+                        if (writeFsBlock(mountedFD, fileInode.filePointer, &fileInode) < 0) return WRITE_ERROR;
+                        return writeAllocator(mountedFD, &superblock, index);
                     }
-                    //update file inode
-                    fileInode.firstFileExtentPtr = -1;
-                    //write buffer to file
-                    int ExtentBlocksNeeded = size / (BLOCKSIZE - 3);
-                    if (size % (BLOCKSIZE - 3) != 0) ExtentBlocksNeeded++;
-                    for (int i = 0; i < ExtentBlocksNeeded; i++){
-                        FileExtent newExtentBlock;
-                        Superblock superblock;
-                        newExtentBlock.blockType = 4;
-                        newExtentBlock.magicNumber = MAGIC_NUMBER;
-                        if (readBlock(mountedFD, 0, &superblock) < 0) return READ_ERROR;
-                        if (superblock.freeBlockPtr == -1) return OUT_OF_BLOCKS; // No free blocks
-                        int extentTargetBlock = superblock.freeBlockPtr;
-                        FreeBlock targetFreeBlock;
-                        if (readBlock(mountedFD, superblock.freeBlockPtr, &targetFreeBlock) < 0) return READ_ERROR;
-
-                        //write data to extent block
-                        for (int j = 0; j < BLOCKSIZE - 3; j++){
-                            if (i * (BLOCKSIZE - 3) + j < size){
-                                newExtentBlock.data[j] = buffer[i * (BLOCKSIZE - 3) + j];
-                            }
-                            else {
-                                newExtentBlock.data[j] = '\0';
-                            }
-                        }
-                        //update free block list
-                        if (i < ExtentBlocksNeeded - 1){
-                            newExtentBlock.nextDataBlock = targetFreeBlock.nextFreeBlock;
-                        }
-                        else {
-                            newExtentBlock.nextDataBlock = -1;
-                        }
-                        superblock.freeBlockPtr = targetFreeBlock.nextFreeBlock;
 
-                        //write extent block to disk
-                        if (writeBlock(mountedFD, extentTargetBlock, &newExtentBlock) < 0) return WRITE_ERROR;
-                        if (writeBlock(mountedFD, 0, &superblock) < 0) return WRITE_ERROR;
+                    //a write the free blocks cannot hold takes back the other files' headroom
+                    //first, while the old content is still there to fall back on
+                    int wanted = (reserve > needed) ? reserve : needed;
+                    if (extentDataSize >= 0 && wanted > countFreeBlocks(&superblock)){
+                        result = releaseHeadroom(mountedFD, fileInode.filePointer);
+                        if (result > 0) result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+                        if (result < 0) return result;
+                    }
 
-                        //link extent block to file inode if first extent block
-                        if (i == 0){
-                            fileInode.firstFileExtentPtr = extentTargetBlock;
-                        }
+                    //otherwise release its extents, shared blocks only lose a reference.
+                    //the allocator is only written back once the new content is laid out
+                    result = releaseExtents(mountedFD, &superblock, index, first, length);
+                    if (result < 0) return result;
+                    if (reserve < 0 && (reserved || growing) && needed > length) capacity = needed + needed / GROWTH_RESERVE;
 
+                    //write buffer to file
+                    if (extentDataSize < 0) first = OUT_OF_BLOCKS; // the stream does not fit on the disk
+                    //reserved files are not deduplicated, their blocks are rewritten in place
+                    else if (index != NULL && !reserved) first = writeDedupExtents(mountedFD, &superblock, index, extentData, extentDataSize);
+                    else {
+                        first = writeExtents(mountedFD, &superblock, extentData, extentDataSize, capacity);
+                        //headroom is only taken from space no one needs
+                        if (first == OUT_OF_BLOCKS && reserve < 0 && capacity > needed){
+                            capacity = needed;
+                            first = writeExtents(mountedFD, &superblock, extentData, extentDataSize, capacity);
+                        }
+                    }
+                    //an explicit reservation that does not fit leaves the file as it was
+                    if (first == OUT_OF_BLOCKS && reserve >= 0) return OUT_OF_BLOCKS;
+                    if (writeAllocator(mountedFD, &superblock, index) < 0) return WRITE_ERROR;
+                    if (first < -1){
+                        //the old content is gone either way, leave the file empty
+                        fileInode.fileSize = 0;
+                        fileInode.dataSize = 0;
+                        writeFsBlock(mountedFD, fileInode.filePointer, &fileInode);
+                        return first;
                     }
+
                     //update file inode
-                    fileInode.fileSize = size;
-                    if (writeBlock(mountedFD, fileInode.filePointer, &fileInode) < 0) return WRITE_ERROR;
+                    fileInode.firstFileExtentPtr = first;
+                    fileInode.fileSize = (index != NULL && !reserved) ? needed : capacity;
+                    fileInode.dataSize = size;
+                    if (writeFsBlock(mountedFD, fileInode.filePointer, &fileInode) < 0) return WRITE_ERROR;
                     return 0;
                     
                     
@@ -327,24 +1088,16 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
     return INVALID_FD; // File not found in open file table
 }
 
-int append_free_block(unsigned char fbPtr) {
-    int mountedFD = openDisk(mountedDiskname, 0);
-    Superblock sb;
-    if (readBlock(mountedFD, 0, &sb) < 0) return -1;
-    FreeBlock tempFb;
-    if (readBlock(mountedFD, sb.freeBlockPtr, &tempFb) < 0) return -1;
-    unsigned char prev_ptr = sb.freeBlockPtr;
-    while(tempFb.nextFreeBlock != -1) {
-         if (readBlock(mountedFD, tempFb.nextFreeBlock, &tempFb) < 0) return -1;
-         prev_ptr = tempFb.nextFreeBlock;
-    }
-    tempFb.nextFreeBlock = fbPtr;
-    if (writeBlock(mountedFD, prev_ptr, &tempFb) < 0) return -1;
-    return 0;
+/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire
+file’s content, to the file system. Previous content (if any) will be 
+completely lost. Sets the file pointer to 0 (the start of file) when
+done. Returns success/error codes. */
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
+    return commitOperation(writeFileContent(FD, buffer, size, -1));
 }
 
 int getInodeFromFD(fileDescriptor FD) {
-    int mountedFD = openDisk(mountedDiskname, 0);
+    int mountedFD = mountedDisk;
     OpenFileEntry *current_entry = openFileTable;
     while(current_entry != NULL) {
         if (current_entry->fileDescriptor == FD) {
@@ -356,24 +1109,13 @@ int getInodeFromFD(fileDescriptor FD) {
         return -1;
     }
     //find inode with the same filename
-    Inode rootInode;
-    readBlock(mountedFD, 1, &rootInode);
-    Inode tempInode = rootInode;
-    unsigned char prev_inode_ptr = -1;
-    while(tempInode.nextInodePtr != -1) {
-        if (strcmp(tempInode.fileName, current_entry->filename) == 0) {
-            //found the file
-            break;
-        }
-        prev_inode_ptr = tempInode.nextInodePtr;
-        if (readBlock(mountedFD, tempInode.nextInodePtr, &tempInode) < 0) return -1; //bad inode ptr
-    }
-    return prev_inode_ptr;
+    Inode tempInode;
+    return findInodeByName(mountedFD, current_entry->filename, &tempInode);
 }
 
 
 int tfs_deleteFile(fileDescriptor FD) {
-    int mountedFD = openDisk(mountedDiskname, 0);
+    int mountedFD = mountedDisk;
     OpenFileEntry *current_entry = openFileTable;
     while(current_entry != NULL) {
         if (current_entry->fileDescriptor == FD) {
@@ -381,49 +1123,48 @@ int tfs_deleteFile(fileDescriptor FD) {
         }
         current_entry = current_entry->nextEntry;
     }
-    //find inode with the same filename
-    Inode rootInode;
-    if (readBlock(mountedFD, 1, &rootInode) < 0) return -1;
-    Inode tempInode = rootInode;
-    unsigned char prev_inode_ptr = -1;
-    while(tempInode.nextInodePtr != -1) {
+    if (current_entry == NULL) return INVALID_FD;
+    invalidateFileCache(current_entry->filename);
+    //find inode with the same filename, and the inode linking to it
+    Inode prevInode;
+    Inode tempInode;
+    if (readFsBlock(mountedFD, 1, &prevInode) < 0) return READ_ERROR;
+    int inodeBlock = prevInode.nextInodePtr;
+    while(inodeBlock != -1) {
+        if (readFsBlock(mountedFD, inodeBlock, &tempInode) < 0) return READ_ERROR; //bad inode ptr
         if (strcmp(tempInode.fileName, current_entry->filename) == 0) {
             //found the file
             break;
         }
-        prev_inode_ptr = tempInode.nextInodePtr;
-        if (readBlock(mountedFD, tempInode.nextInodePtr, &tempInode) < 0) return -1; //bad inode ptr
+        prevInode = tempInode;
+        inodeBlock = tempInode.nextInodePtr;
     }
-    FileExtent tempFileExtent;
-    unsigned char prev_ptr = tempInode.firstFileExtentPtr;
-    unsigned char first_ptr = tempInode.firstFileExtentPtr;
-    if (readBlock(mountedFD, tempInode.firstFileExtentPtr, &tempFileExtent) < 0) return -1;
-    //free all the blocks
-    while(tempFileExtent.nextDataBlock != -1) {
-        FreeBlock fb = {4, 0x44, tempFileExtent.nextDataBlock, NULL, NULL};
-        if (writeBlock(mountedFD, prev_ptr, &fb) < 0) return -1;
-        prev_ptr = tempFileExtent.nextDataBlock;
-        if (readBlock(mountedFD, tempFileExtent.nextDataBlock, &tempFileExtent) < 0) return -1;
-    }
-    //free the last block, and finally the inode   
-    FreeBlock fb = {4, 0x44, tempFileExtent.nextDataBlock, NULL, NULL};
-    if (writeBlock(mountedFD, prev_ptr, &fb) < 0) return -1;
-    fb.nextFreeBlock = first_ptr;
-    if (writeBlock(mountedFD, prev_inode_ptr, &fb) < 0) return -1;
-    //insert the free block chain to all free blocks
-    append_free_block(prev_inode_ptr);
-    return 0;
+    if (inodeBlock == -1) return NO_INODE_MATCHING_FD;
+
+    //free the extents, shared blocks only lose a reference
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+    if (result == 0) result = releaseExtents(mountedFD, &superblock, index, tempInode.firstFileExtentPtr, tempInode.fileSize);
+    if (result < 0) return result;
+
+    //unlink the inode and free its block
+    prevInode.nextInodePtr = tempInode.nextInodePtr;
+    if (writeFsBlock(mountedFD, prevInode.filePointer, &prevInode) < 0) return WRITE_ERROR;
+    pushFreeBlock(&superblock, inodeBlock);
+    return commitOperation(writeAllocator(mountedFD, &superblock, index));
 }
 
 int tfs_readByte(fileDescriptor FD, char *buffer) {
-    int mountedFD = openDisk(mountedDiskname, 0);
+    int mountedFD = mountedDisk;
     int inodePtr = getInodeFromFD(FD);
     if (inodePtr == -1) {
         //no inode found, file not open prob
         return -1;
     }
     Inode tempInode;
-    if (readBlock(mountedFD, inodePtr, &tempInode) < 0) return -1;
+    if (readFsBlock(mountedFD, inodePtr, &tempInode) < 0) return -1;
     OpenFileEntry *current_entry = openFileTable;
     while(current_entry != NULL) {
         if (current_entry->fileDescriptor == FD) {
@@ -436,17 +1177,28 @@ int tfs_readByte(fileDescriptor FD, char *buffer) {
         return -1;
     }
     int offset = current_entry->offset;
-    if (offset >= tempInode.fileSize) {
+    if (offset >= tempInode.dataSize) {
         return -1;
     }
-    int block_count = floor(offset / (BLOCKSIZE - 4));
-    int remainder_offset = offset % (BLOCKSIZE - 4);
+    //inline files need no extent read
+    if (tempInode.flags & INODE_INLINE) {
+        *buffer = tempInode.inlineData[offset];
+        current_entry->offset++;
+        return 0;
+    }
+    if (tempInode.flags & INODE_COMPRESSED) {
+        if (readCompressedByte(mountedFD, &tempInode, current_entry->filename, offset, buffer) < 0) return -1;
+        current_entry->offset++;
+        return 0;
+    }
+    int block_count = floor(offset / (BLOCKSIZE - 3));
+    int remainder_offset = offset % (BLOCKSIZE - 3);
     //get the first data block
     FileExtent tempFileExtent;
-    if (readBlock(mountedFD, tempInode.firstFileExtentPtr, &tempFileExtent) < 0) return -1;
+    if (readFsBlock(mountedFD, tempInode.firstFileExtentPtr, &tempFileExtent) < 0) return -1;
     //read the rest of them
     while(block_count > 0) {
-        if (readBlock(mountedFD, tempFileExtent.nextDataBlock, &tempFileExtent) < 0) return -1;
+        if (readFsBlock(mountedFD, tempFileExtent.nextDataBlock, &tempFileExtent) < 0) return -1;
         block_count--;
     }
     memcpy(buffer, tempFileExtent.data + remainder_offset, 1);
@@ -469,6 +1221,889 @@ int tfs_seek(fileDescriptor FD, int offset) {
     return 0;
 }
 
+/* Returns in ‘ref’ a pointer to the file's data at byte ‘offset’ and in
+‘length’ how many bytes can be read from it in place, up to the end of the
+block (or decompressed chunk) holding that offset. No copy is made: the
+pointer is into a page pinned for the caller, which must hand it back
+with tfs_release. The page keeps its contents even if the file is
+rewritten meanwhile. Refs end with tfs_unmount. The file pointer is not
+moved. At the end of the file ‘ref’ is NULL and ‘length’ 0. Returns
+success/error codes. */
+int tfs_readRef(fileDescriptor FD, int offset, char **ref, int *length) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    *ref = NULL;
+    *length = 0;
+    OpenFileEntry *current_entry = openFileTable;
+    while (current_entry != NULL && current_entry->fileDescriptor != FD) current_entry = current_entry->nextEntry;
+    if (current_entry == NULL) return INVALID_FD;
+    Inode inode;
+    if (findInodeByName(mountedFD, current_entry->filename, &inode) == -1) return NO_INODE_MATCHING_FD;
+    if (offset < 0) return READ_ERROR;
+    if (offset >= inode.dataSize) return 0;
+
+    //inline files are never compressed, whatever their flags say
+    if ((inode.flags & INODE_COMPRESSED) && !(inode.flags & INODE_INLINE)) {
+        ChunkCacheEntry *entry;
+        int result = getChunk(mountedFD, &inode, current_entry->filename, offset / COMPRESS_CHUNK_SIZE, &entry);
+        if (result < 0) return result;
+        if (offset % COMPRESS_CHUNK_SIZE >= entry->length) return READ_ERROR;
+        entry->pins++;
+        *ref = entry->data + offset % COMPRESS_CHUNK_SIZE;
+        *length = entry->length - offset % COMPRESS_CHUNK_SIZE;
+        return 0;
+    }
+
+    int inlineData = inode.flags & INODE_INLINE;
+    int index = inlineData ? -1 : offset / (BLOCKSIZE - 3);
+    RefPage *page = NULL;
+    RefPage *previous = NULL;
+    RefPage *spare = NULL;
+    for (int i = 0; i < REF_PAGES; i++) {
+        RefPage *candidate = &refPages[i];
+        if (candidate->pins == 0 && (spare == NULL || candidate->filename[0] == '\0')) spare = candidate;
+        if (strcmp(candidate->filename, current_entry->filename) != 0) continue;
+        if (candidate->index == index) page = candidate;
+        //a page earlier in the chain saves walking it from the start
+        else if (candidate->index < index && (previous == NULL || candidate->index > previous->index)) previous = candidate;
+    }
+    if (page == NULL) {
+        if (spare == NULL) return TOO_MANY_REFERENCES; // every page is pinned
+        page = spare;
+        page->filename[0] = '\0';
+        if (inlineData) memcpy(page->block, &inode, BLOCKSIZE);
+        else {
+            int block = inode.firstFileExtentPtr;
+            int steps = index;
+            if (previous != NULL) {
+                block = ((FileExtent *) previous->block)->nextDataBlock;
+                steps = index - previous->index - 1;
+            }
+            //the walk reads straight into the page, the last read is the one kept
+            for (;;) {
+                if (block == -1 || readFsBlock(mountedFD, block, page->block) < 0) return READ_ERROR;
+                if (steps-- == 0) break;
+                block = ((FileExtent *) page->block)->nextDataBlock;
+            }
+        }
+        strcpy(page->filename, current_entry->filename);
+        page->index = index;
+    }
+
+    page->pins++;
+    if (inlineData) {
+        *ref = page->block + offsetof(Inode, inlineData) + offset;
+        *length = inode.dataSize - offset;
+    }
+    else {
+        *ref = ((FileExtent *) page->block)->data + offset % (BLOCKSIZE - 3);
+        *length = BLOCKSIZE - 3 - offset % (BLOCKSIZE - 3);
+        if (*length > inode.dataSize - offset) *length = inode.dataSize - offset;
+    }
+    return 0;
+}
+
+/* Hands back a pointer returned by tfs_readRef, unpinning its page.
+Returns success/error codes. */
+int tfs_release(char *ref) {
+    for (int i = 0; i < REF_PAGES; i++) {
+        if (refPages[i].pins > 0 && ref >= refPages[i].block && ref < refPages[i].block + BLOCKSIZE) {
+            refPages[i].pins--;
+            return 0;
+        }
+    }
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+        if (chunkCache[i].pins > 0 && ref >= chunkCache[i].data && ref < chunkCache[i].data + COMPRESS_CHUNK_SIZE) {
+            chunkCache[i].pins--;
+            return 0;
+        }
+    }
+    return INVALID_REF;
+}
+
+/* Writes back the blocks a batch left in the cache, data before the
+superblock, in runs of consecutive blocks. Blocks free by the end of the
+batch are not written at all. Then trims the blocks the batch freed. */
+static int endBatch(void){
+    batchActive = 0;
+    Superblock *superblock = (Superblock *) batchBlocks[0];
+    int result = 0;
+    int start = -1;
+    for (int block = 1; block <= MAX_BLOCKS; block++){
+        int dirty = block < MAX_BLOCKS && batchDirty[block]
+            && !(batchValid[0] && isFreeBlock(superblock, block));
+        if (dirty){
+            if (start == -1) start = block;
+            continue;
+        }
+        if (start != -1 && writeFsBlocks(mountedDisk, start, block - start, batchBlocks[start]) < 0) result = WRITE_ERROR;
+        start = -1;
+    }
+    if (batchDirty[0] && writeFsBlock(mountedDisk, 0, batchBlocks[0]) < 0) result = WRITE_ERROR;
+    if (result == 0 && batchValid[0]) trimFreeBlocks(mountedDisk, superblock, trimPending);
+    memset(trimPending, 0, sizeof(trimPending));
+    memset(batchValid, 0, sizeof(batchValid));
+    memset(batchDirty, 0, sizeof(batchDirty));
+    return result;
+}
+
+//copies up to ‘size’ bytes from ‘offset’ on into ‘buffer’, returns how many
+static int readFileData(fileDescriptor FD, int offset, char *buffer, int size){
+    int done = 0;
+    while (done < size){
+        char *ref;
+        int length;
+        int result = tfs_readRef(FD, offset + done, &ref, &length);
+        if (result < 0) return result;
+        if (ref == NULL) break; // end of file
+        if (length > size - done) length = size - done;
+        memcpy(buffer + done, ref, length);
+        tfs_release(ref);
+        done += length;
+    }
+    return done;
+}
+
+//copies up to ‘size’ bytes from the file pointer into ‘buffer’ and moves the pointer past them
+static int batchRead(fileDescriptor FD, char *buffer, int size){
+    OpenFileEntry *entry = openFileTable;
+    while (entry != NULL && entry->fileDescriptor != FD) entry = entry->nextEntry;
+    if (entry == NULL) return INVALID_FD;
+    int done = readFileData(FD, entry->offset, buffer, size);
+    if (done > 0) entry->offset += done;
+    return done;
+}
+
+/* Runs the ‘count’ operations in ‘ops’ in order, as if each had been
+called on its own, and stores what that call would have returned in each
+op's result field. A failed operation does not stop the ones after it.
+An op whose fdFromOp is BATCH_FROM_OP(i) works on the file earlier op i
+opened instead of on its fd, so a file can be opened and written in the
+same batch; it fails with INVALID_FD if op i does not come before it or
+did not open a file. A negative fd, as a failed open returns, is
+INVALID_FD too.
+Blocks are written back only once every operation has run, so files
+opened, written and deleted together share their directory lookups and
+allocator updates, and the blocks they wrote reach the disk in as few
+writes as possible. Returns success/error codes for that write back. */
+int tfs_batch(BatchOp *ops, int count){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    batchActive = 1;
+    for (int i = 0; i < count; i++){
+        BatchOp *op = &ops[i];
+        fileDescriptor fd = op->fd;
+        if (op->op != BATCH_OPEN && op->fdFromOp != 0){
+            int opened = op->fdFromOp - 1;
+            fd = (opened >= 0 && opened < i && ops[opened].op == BATCH_OPEN) ? ops[opened].result : INVALID_FD;
+        }
+        if (fd < 0 && op->op != BATCH_OPEN && op->op >= BATCH_READ && op->op <= BATCH_DELETE){
+            op->result = INVALID_FD;
+            continue;
+        }
+        switch (op->op){
+            case BATCH_OPEN: op->result = tfs_openFile(op->name); break;
+            case BATCH_READ: op->result = batchRead(fd, op->buffer, op->size); break;
+            case BATCH_WRITE: op->result = tfs_writeFile(fd, op->buffer, op->size); break;
+            case BATCH_SEEK: op->result = tfs_seek(fd, op->size) < 0 ? INVALID_FD : 0; break;
+            case BATCH_DELETE: op->result = tfs_deleteFile(fd); break;
+            default: op->result = INVALID_OP;
+        }
+    }
+    return commitOperation(endBatch());
+}
+
+//content of a file being reallocated by tfs_fallocate
+static char fileData[USHRT_MAX];
+
+/* Reserves room for ‘bytes’ of data in an open file, as one run of
+consecutive blocks if the disk has one, moving its current content there.
+From then on tfs_writeFile rewrites the file in place as long as its
+content fits, and the file keeps its blocks when it shrinks. Content that
+outgrows the reservation is laid out anew with room to grow. A ‘bytes’ of
+0 drops the reservation, leaving the file the blocks its content needs. If
+the reservation does not fit on the disk the file is left as it was.
+Returns success/error codes. */
+int tfs_fallocate(fileDescriptor FD, int bytes){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    if (bytes > USHRT_MAX) return FILE_TOO_LARGE;
+    if (bytes < 0) bytes = 0;
+    int size = readFileData(FD, 0, fileData, sizeof(fileData));
+    if (size < 0) return size;
+    return commitOperation(writeFileContent(FD, fileData, size, (bytes + BLOCKSIZE - 4) / (BLOCKSIZE - 3)));
+}
+
+/* Sets when writes to the mounted file system are made durable, until it
+is unmounted. DURABILITY_NONE leaves it to the host, as TinyFS always has.
+DURABILITY_CLOSE syncs the disk when a file is closed and on unmount.
+DURABILITY_PERIODIC syncs it from a background thread every ‘periodMs’
+milliseconds if anything was written, and on unmount. DURABILITY_SYNC
+syncs it before every call that writes returns, the operations of a
+tfs_batch sharing one sync at its end. What was written before is synced
+when a policy other than DURABILITY_NONE is set. Returns success/error
+codes. */
+int tfs_setDurability(int mode, int periodMs){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    if (mode < DURABILITY_NONE || mode > DURABILITY_SYNC) return INVALID_MODE;
+    if (mode == DURABILITY_PERIODIC && periodMs <= 0) return INVALID_MODE;
+    stopFlusher();
+    durability = mode;
+    flushPeriodMs = periodMs;
+    int result = (mode != DURABILITY_NONE) ? syncMounted() : 0;
+    if (mode == DURABILITY_PERIODIC){
+        flusherRunning = 1;
+        if (pthread_create(&flusher, NULL, flushLoop, NULL) != 0){
+            flusherRunning = 0;
+            durability = DURABILITY_NONE;
+            return INVALID_MODE;
+        }
+    }
+    return result;
+}
+
+/* Turns compression on or off for an open file. Takes effect the next time
+the file is written with tfs_writeFile, existing content is left as is.
+Returns success/error codes. */
+int tfs_setCompression(fileDescriptor FD, int enabled) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    int inodePtr = getInodeFromFD(FD);
+    if (inodePtr == -1) return INVALID_FD;
+    Inode inode;
+    if (readFsBlock(mountedFD, inodePtr, &inode) < 0) return READ_ERROR;
+    if (enabled) inode.flags |= INODE_COMPRESS;
+    else inode.flags &= ~INODE_COMPRESS;
+    if (writeFsBlock(mountedFD, inodePtr, &inode) < 0) return WRITE_ERROR;
+    return commitOperation(0);
+}
+
+/* Turns deduplication of extent blocks on or off for the mounted file
+system. Turning it on allocates the fingerprint index and fills it from the
+extents already on disk, from then on tfs_writeFile shares blocks that are
+identical to existing ones instead of writing them. Turning it off frees
+the index, blocks that are already shared stay shared. Returns
+success/error codes. */
+int tfs_setDedup(int enabled) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    Superblock superblock;
+    if (readFsBlock(mountedFD, 0, &superblock) < 0) return READ_ERROR;
+
+    if (enabled && superblock.dedupIndexPtr == -1) {
+        int indexBlock = popFreeBlock(&superblock);
+        if (indexBlock < 0) return indexBlock;
+
+        DedupIndex index;
+        memset(&index, 0, sizeof(DedupIndex));
+        index.blockType = 5;
+        index.magicNumber = MAGIC_NUMBER;
+        //fingerprint the extents of every file, shared tails only once
+        Inode inode;
+        if (readFsBlock(mountedFD, 1, &inode) < 0) return READ_ERROR;
+        while (inode.nextInodePtr != -1) {
+            if (readFsBlock(mountedFD, inode.nextInodePtr, &inode) < 0) return READ_ERROR;
+            int extentBlock = inode.firstFileExtentPtr;
+            while (extentBlock >= 2 && extentBlock < MAX_BLOCKS && index.fingerprint[extentBlock - 2] == 0) {
+                FileExtent extent;
+                if (readFsBlock(mountedFD, extentBlock, &extent) < 0) return READ_ERROR;
+                index.fingerprint[extentBlock - 2] = fingerprintBlock(&extent);
+                extentBlock = extent.nextDataBlock;
+            }
+        }
+        if (writeFsBlock(mountedFD, indexBlock, &index) < 0) return WRITE_ERROR;
+        superblock.dedupIndexPtr = indexBlock;
+    }
+    else if (!enabled && superblock.dedupIndexPtr != -1) {
+        pushFreeBlock(&superblock, superblock.dedupIndexPtr);
+        superblock.dedupIndexPtr = -1;
+    }
+    return commitOperation(writeAllocator(mountedFD, &superblock, NULL));
+}
+
+/* Makes file ‘dstName’ a copy of file ‘srcName’ without copying any data.
+The copy shares the source's extents, which are reference counted and never
+changed in place, so a later tfs_writeFile to either file leaves the other
+as it was. An existing ‘dstName’ is overwritten. Returns success/error
+codes. */
+int tfs_clone(char *srcName, char *dstName) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    Inode source;
+    int sourceBlock = findInodeByName(mountedFD, srcName, &source);
+    if (sourceBlock == -1) return NO_INODE_MATCHING_FD;
+    Inode target;
+    int targetBlock = findInodeByName(mountedFD, dstName, &target);
+    if (targetBlock == sourceBlock) return 0;
+
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+    if (result < 0) return result;
+
+    Inode copy = source;
+    strncpy((char *) copy.fileName, dstName, 8);
+    copy.fileName[8] = '\0';
+    if (targetBlock != -1) {
+        //reuse the target's inode, dropping its old extents
+        int first = copy.firstFileExtentPtr;
+        if (first != -1 && superblock.refCount[first] == UCHAR_MAX) return TOO_MANY_REFERENCES;
+        if (first != -1) superblock.refCount[first]++;
+        result = releaseExtents(mountedFD, &superblock, index, target.firstFileExtentPtr, target.fileSize);
+        if (result < 0) return result;
+        copy.filePointer = targetBlock;
+        copy.nextInodePtr = target.nextInodePtr;
+        if (writeFsBlock(mountedFD, targetBlock, &copy) < 0) return WRITE_ERROR;
+    }
+    else {
+        //new inodes go right after the root inode
+        Inode rootInode;
+        if (readFsBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
+        int block = copyInode(mountedFD, &superblock, &copy, rootInode.nextInodePtr);
+        if (block < 0) return block;
+        rootInode.nextInodePtr = block;
+        if (writeFsBlock(mountedFD, 1, &rootInode) < 0) return WRITE_ERROR;
+    }
+    invalidateFileCache(dstName);
+    return commitOperation(writeAllocator(mountedFD, &superblock, index));
+}
+
+/* Freezes the current contents of every file. Each file gets a copy of its
+inode on the snapshot chain that shares its extents, so a snapshot costs
+one block per file however large the files are. Any previous snapshot is
+replaced. Returns success/error codes. */
+int tfs_snapshot(void) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+    if (result == 0) result = releaseInodeChain(mountedFD, &superblock, index, superblock.snapshotInodePtr);
+    if (result < 0) return result;
+    superblock.snapshotInodePtr = -1;
+
+    Inode inode;
+    if (readFsBlock(mountedFD, 1, &inode) < 0) return READ_ERROR;
+    while (result == 0 && inode.nextInodePtr != -1) {
+        if (readFsBlock(mountedFD, inode.nextInodePtr, &inode) < 0) return READ_ERROR;
+        int block = copyInode(mountedFD, &superblock, &inode, superblock.snapshotInodePtr);
+        if (block < 0) result = block;
+        else superblock.snapshotInodePtr = block;
+    }
+    //a partial snapshot is still consistent, keep the allocator in step with it
+    if (writeAllocator(mountedFD, &superblock, index) < 0) return WRITE_ERROR;
+    return commitOperation(result);
+}
+
+/* Returns every file to its state at the last tfs_snapshot. Files created
+since then are deleted. The snapshot is kept, so it can be restored again.
+Returns success/error codes. */
+int tfs_restoreSnapshot(void) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+    if (result < 0) return result;
+    if (superblock.snapshotInodePtr == -1) return NO_SNAPSHOT;
+
+    //the snapshot holds its own references, so shared extents survive this
+    Inode rootInode;
+    if (readFsBlock(mountedFD, 1, &rootInode) < 0) return READ_ERROR;
+    result = releaseInodeChain(mountedFD, &superblock, index, rootInode.nextInodePtr);
+    rootInode.nextInodePtr = -1;
+
+    int block = superblock.snapshotInodePtr;
+    while (result == 0 && block != -1) {
+        Inode inode;
+        if (readFsBlock(mountedFD, block, &inode) < 0) return READ_ERROR;
+        int copy = copyInode(mountedFD, &superblock, &inode, rootInode.nextInodePtr);
+        if (copy < 0) result = copy;
+        else rootInode.nextInodePtr = copy;
+        block = inode.nextInodePtr;
+    }
+    invalidateFileCache(NULL);
+    if (writeFsBlock(mountedFD, 1, &rootInode) < 0) return WRITE_ERROR;
+    if (writeAllocator(mountedFD, &superblock, index) < 0) return WRITE_ERROR;
+    return commitOperation(result);
+}
+
+/* Discards the snapshot, freeing whatever only it still referenced.
+Returns success/error codes. */
+int tfs_dropSnapshot(void) {
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    Superblock superblock;
+    DedupIndex indexBlock;
+    DedupIndex *index;
+    int result = readAllocator(mountedFD, &superblock, &indexBlock, &index);
+    if (result == 0) result = releaseInodeChain(mountedFD, &superblock, index, superblock.snapshotInodePtr);
+    if (result < 0) return result;
+    superblock.snapshotInodePtr = -1;
+    return commitOperation(writeAllocator(mountedFD, &superblock, index));
+}
+
+
+/* In-memory copy of the mounted disk used by the defragmenter. order[]
+lists the live blocks in the layout we want on disk: superblock, root inode,
+dedup index, then every file inode immediately followed by its extents,
+live files first and then the snapshot.
+role[] says how each block's pointers are to be read, so every reference
+to a block can be patched when it is moved. */
+#define ROLE_NONE 0
+#define ROLE_SUPER 1
+#define ROLE_INODE 2
+#define ROLE_EXTENT 3
+#define ROLE_FREE 4
+#define ROLE_INDEX 5
+
+typedef struct {
+    int nBlocks;
+    char image[MAX_BLOCKS][BLOCKSIZE];
+    int nLive;
+    int order[MAX_BLOCKS];
+    int role[MAX_BLOCKS];
+} DiskLayout;
+
+static int claimBlock(DiskLayout *layout, int block, int role){
+    if (block < 0 || block >= layout->nBlocks) return FS_INCONSISTENT; // pointer off the disk
+    if (layout->role[block] != ROLE_NONE) return FS_INCONSISTENT; // block reached twice
+    layout->role[block] = role;
+    layout->order[layout->nLive++] = block;
+    return 0;
+}
+
+static int isLive(DiskLayout *layout, int block){
+    return layout->role[block] != ROLE_NONE && layout->role[block] != ROLE_FREE;
+}
+
+/* Walks the inode chain and every extent chain of the in-memory image and
+fills in the target order. Only a broken inode or extent chain makes the
+disk unusable here: the free map is rebuilt at the end anyway, so blocks
+it wrongly marks free are simply live. */
+static int buildLayout(DiskLayout *layout){
+    Superblock *superblock = (Superblock *) layout->image[0];
+    memset(layout->role, 0, sizeof(layout->role));
+    layout->nLive = 0;
+
+    if (claimBlock(layout, 0, ROLE_SUPER) < 0) return FS_INCONSISTENT;
+    int inodeBlock = 1;
+    int inSnapshot = 0;
+    while (inodeBlock != -1){
+        if (claimBlock(layout, inodeBlock, ROLE_INODE) < 0) return FS_INCONSISTENT;
+        Inode *inode = (Inode *) layout->image[inodeBlock];
+
+        int extentBlock = inode->firstFileExtentPtr;
+        while (extentBlock != -1){
+            //a shared tail is laid out with the first file that reaches it
+            if (extentBlock >= 0 && extentBlock < layout->nBlocks && layout->role[extentBlock] == ROLE_EXTENT
+                && superblock->refCount[extentBlock] > 0) break;
+            if (claimBlock(layout, extentBlock, ROLE_EXTENT) < 0) return FS_INCONSISTENT;
+            extentBlock = ((FileExtent *) layout->image[extentBlock])->nextDataBlock;
+        }
+
+        if (inodeBlock == 1 && superblock->dedupIndexPtr != -1){
+            if (claimBlock(layout, superblock->dedupIndexPtr, ROLE_INDEX) < 0) return FS_INCONSISTENT;
+        }
+        //snapshot inodes follow the live ones
+        inodeBlock = inode->nextInodePtr;
+        if (inodeBlock == -1 && !inSnapshot){
+            inSnapshot = 1;
+            inodeBlock = superblock->snapshotInodePtr;
+        }
+    }
+
+    for (int i = 0; i < layout->nBlocks; i++){
+        if (layout->role[i] == ROLE_NONE && isFreeBlock(superblock, i)) layout->role[i] = ROLE_FREE;
+    }
+    return 0;
+}
+
+//reads the whole disk into the layout's image, in block order
+static int readImage(int disk, DiskLayout *layout){
+    if (readBlock(disk, 0, layout->image[0]) < 0) return READ_ERROR;
+    if (readBlock(disk, 1, layout->image[1]) < 0) return READ_ERROR;
+    layout->nBlocks = (unsigned char) ((Inode *) layout->image[1])->fileSize;
+    if (layout->nBlocks < 2 || layout->nBlocks > MAX_BLOCKS) return FS_INCONSISTENT;
+    if (readBlocks(disk, 2, layout->nBlocks - 2, layout->image[2]) < 0) return READ_ERROR;
+    return 0;
+}
+
+static int loadLayout(int disk, DiskLayout *layout){
+    int result = readImage(disk, layout);
+    if (result < 0) return result;
+    return buildLayout(layout);
+}
+
+static void remapPointer(char *pointer, int a, int b, int *changed){
+    if (*pointer == a){
+        *pointer = b;
+        *changed = 1;
+    }
+    else if (*pointer == b){
+        *pointer = a;
+        *changed = 1;
+    }
+}
+
+/* Exchanges the contents of blocks a and b (never the superblock or root
+inode) and repoints every reference to them. Returns the number of blocks
+written. */
+static int swapBlocks(int disk, DiskLayout *layout, int a, int b){
+    char temp[BLOCKSIZE];
+    memcpy(temp, layout->image[a], BLOCKSIZE);
+    memcpy(layout->image[a], layout->image[b], BLOCKSIZE);
+    memcpy(layout->image[b], temp, BLOCKSIZE);
+    int role = layout->role[a];
+    layout->role[a] = layout->role[b];
+    layout->role[b] = role;
+
+    int written = 0;
+    for (int i = 0; i < layout->nBlocks; i++){
+        int changed = (i == a || i == b);
+        if (layout->role[i] == ROLE_SUPER){
+            Superblock *superblock = (Superblock *) layout->image[i];
+            remapPointer(&superblock->dedupIndexPtr, a, b, &changed);
+            remapPointer(&superblock->snapshotInodePtr, a, b, &changed);
+            unsigned char refCount = superblock->refCount[a];
+            superblock->refCount[a] = superblock->refCount[b];
+            superblock->refCount[b] = refCount;
+            if (superblock->refCount[a] != superblock->refCount[b]) changed = 1;
+            int free = isFreeBlock(superblock, a);
+            setFreeBlock(superblock, a, isFreeBlock(superblock, b));
+            setFreeBlock(superblock, b, free);
+            if (isFreeBlock(superblock, a) != isFreeBlock(superblock, b)) changed = 1;
+        }
+        else if (layout->role[i] == ROLE_INODE){
+            Inode *inode = (Inode *) layout->image[i];
+            remapPointer(&inode->nextInodePtr, a, b, &changed);
+            remapPointer(&inode->firstFileExtentPtr, a, b, &changed);
+            inode->filePointer = i; // inodes keep their own block number
+        }
+        else if (layout->role[i] == ROLE_EXTENT){
+            remapPointer(&((FileExtent *) layout->image[i])->nextDataBlock, a, b, &changed);
+        }
+        else if (layout->role[i] == ROLE_INDEX){
+            DedupIndex *index = (DedupIndex *) layout->image[i];
+            unsigned short fingerprint = index->fingerprint[a - 2];
+            index->fingerprint[a - 2] = index->fingerprint[b - 2];
+            index->fingerprint[b - 2] = fingerprint;
+            if (index->fingerprint[a - 2] != index->fingerprint[b - 2]) changed = 1;
+        }
+        if (!changed) continue;
+        if (writeFsBlock(disk, i, layout->image[i]) < 0) return WRITE_ERROR;
+        written++;
+    }
+    return written;
+}
+
+static void fillFragStats(DiskLayout *layout, FragStats *stats){
+    memset(stats, 0, sizeof(FragStats));
+    stats->totalBlocks = layout->nBlocks;
+    stats->usedBlocks = layout->nLive;
+    stats->freeBlocks = layout->nBlocks - layout->nLive;
+    //order[0] is the superblock and order[1] the root inode
+    for (int i = 2; i < layout->nLive; i++){
+        int block = layout->order[i];
+        if (layout->role[block] == ROLE_INODE){
+            stats->files++;
+            stats->fileFragments++;
+        }
+        else if (layout->role[block] == ROLE_EXTENT && block != layout->order[i - 1] + 1) stats->fileFragments++;
+    }
+    for (int i = 0; i < layout->nLive; i++){
+        if (layout->order[i] != i) stats->misplacedBlocks++;
+    }
+    for (int i = 0; i < layout->nBlocks; i++){
+        if (!isLive(layout, i) && (i == 0 || isLive(layout, i - 1))) stats->freeRuns++;
+    }
+}
+
+/* Fills ‘stats’ with fragmentation metrics for the mounted file system.
+Returns 0 or an error code. */
+int tfs_fragStats(FragStats *stats){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    DiskLayout *layout = malloc(sizeof(DiskLayout));
+    int result = loadLayout(mountedFD, layout);
+    if (result == 0) fillFragStats(layout, stats);
+    free(layout);
+    return result;
+}
+
+/* Defragments the mounted file system in place. Every file's inode and
+extents are moved into one ascending run, in inode chain order, and the
+remaining blocks form a single free run at the tail of the disk, whose host
+storage is released. Blocks that were neither live nor free are reclaimed
+and dropped from the dedup index. Moves stop once ‘maxWrites’ block writes have been issued (no limit if
+maxWrites <= 0), so it can be called repeatedly on a mounted file system.
+The free map is only rebuilt once every live block is in place. Returns the number
+of blocks still to be moved (0 when the disk is fully defragmented) or an
+error code. */
+int tfs_defrag(int maxWrites){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    DiskLayout *layout = malloc(sizeof(DiskLayout));
+    int result = loadLayout(mountedFD, layout);
+    int writes = 0;
+
+    //move live blocks into place, one swap at a time
+    for (int i = 0; result == 0 && i < layout->nLive; i++){
+        if (layout->order[i] == i) continue;
+        if (maxWrites > 0 && writes >= maxWrites) break;
+        //cached pages hold block numbers that are about to change
+        invalidateFileCache(NULL);
+        int written = swapBlocks(mountedFD, layout, i, layout->order[i]);
+        if (written < 0) result = written;
+        else {
+            writes += written;
+            result = buildLayout(layout);
+        }
+    }
+
+    int remaining = 0;
+    for (int i = 0; result == 0 && i < layout->nLive; i++){
+        if (layout->order[i] != i) remaining++;
+    }
+
+    //everything after the live blocks is free, and its host storage released
+    Superblock *superblock = (Superblock *) layout->image[0];
+    int changed = 0;
+    for (int i = 0; result == 0 && remaining == 0 && i < layout->nBlocks; i++){
+        int free = (i >= layout->nLive);
+        if (isFreeBlock(superblock, i) == free) continue;
+        setFreeBlock(superblock, i, free);
+        changed = 1;
+    }
+    if (changed && writeFsBlock(mountedFD, 0, superblock) < 0) result = WRITE_ERROR;
+
+    //reclaimed blocks must not be found by dedup either
+    if (result == 0 && remaining == 0 && superblock->dedupIndexPtr != -1){
+        int indexBlock = superblock->dedupIndexPtr;
+        DedupIndex *index = (DedupIndex *) layout->image[indexBlock];
+        int stale = 0;
+        for (int i = 2; i < MAX_BLOCKS; i++){
+            if (index->fingerprint[i - 2] == 0 || (i < layout->nBlocks && layout->role[i] == ROLE_EXTENT)) continue;
+            index->fingerprint[i - 2] = 0;
+            stale = 1;
+        }
+        if (stale && writeFsBlock(mountedFD, indexBlock, index) < 0) result = WRITE_ERROR;
+    }
+    if (result == 0 && remaining == 0) trimFreeBlocks(mountedFD, superblock, superblock->freeMap);
+
+    free(layout);
+    if (result < 0) return commitOperation(result);
+    return commitOperation(remaining);
+}
+
+/* Fills ‘stats’ with deduplication metrics for the mounted file system.
+Returns 0 or an error code. */
+int tfs_dedupStats(DedupStats *stats){
+    if (mountedDiskname == NULL) return NO_FS_MOUNTED;
+    int mountedFD = mountedDisk;
+    DiskLayout *layout = malloc(sizeof(DiskLayout));
+    int result = loadLayout(mountedFD, layout);
+    if (result == 0){
+        memset(stats, 0, sizeof(DedupStats));
+        for (int i = 0; i < layout->nLive; i++){
+            int block = layout->order[i];
+            if (layout->role[block] == ROLE_EXTENT) stats->physicalBlocks++;
+            if (layout->role[block] != ROLE_INODE) continue;
+            //count every block the file reaches, shared or not
+            int extentBlock = ((Inode *) layout->image[block])->firstFileExtentPtr;
+            for (int steps = 0; extentBlock != -1 && steps < layout->nBlocks; steps++){
+                stats->logicalBlocks++;
+                extentBlock = ((FileExtent *) layout->image[extentBlock])->nextDataBlock;
+            }
+        }
+        stats->writesSaved = dedupWritesSaved;
+    }
+    free(layout);
+    return result;
+}
+
+//claims ‘block’ for tfs_check, counting what is wrong with reaching it
+static int checkClaim(DiskLayout *layout, int block, int role, int blockType, CheckReport *report){
+    if (block < 0 || block >= layout->nBlocks){
+        report->brokenChains++;
+        return FS_INCONSISTENT;
+    }
+    if (layout->role[block] != ROLE_NONE){
+        report->crossLinked++;
+        return FS_INCONSISTENT;
+    }
+    if (layout->image[block][0] != blockType || (unsigned char) layout->image[block][1] != MAGIC_NUMBER){
+        report->badBlocks++;
+        return FS_INCONSISTENT;
+    }
+    return claimBlock(layout, block, role);
+}
+
+/* Checks the TinyFS disk ‘diskname’, which does not have to be mountable.
+The whole disk is read in one pass and the inode chain and every extent
+chain are then walked against one map of which blocks have been reached,
+which the free map is compared with, so a block claimed twice, both live
+and free or by nothing is found as well as a broken pointer. Problems are
+counted in ‘report’, as are dedup index entries for blocks that are not
+extents. If ‘repair’ is set, broken pointers are cut, inode sizes and
+reference counts are made to match what was found, the free map is rebuilt
+from every block nothing else reaches and those blocks leave the dedup
+index. Returns the number of problems found (0 for a clean disk) or an
+error code. */
+int tfs_check(char *diskname, int repair, CheckReport *report){
+    memset(report, 0, sizeof(CheckReport));
+    int disk = openDisk(diskname, 0);
+    if (disk < 0) return INVALID_DISK;
+    DiskLayout *layout = malloc(sizeof(DiskLayout));
+    int result = readImage(disk, layout);
+    Superblock *superblock = (Superblock *) layout->image[0];
+    Inode *rootInode = (Inode *) layout->image[1];
+    if (result == 0 && !isCurrentFormat(superblock)) result = NOT_TINYFS_FORMAT;
+    if (result == 0 && (rootInode->blockType != 2 || rootInode->magicNumber != MAGIC_NUMBER)) result = FS_INCONSISTENT;
+    if (result < 0){
+        free(layout);
+        closeDisk(disk);
+        return result;
+    }
+
+    int refs[MAX_BLOCKS] = {0};
+    int dirty[MAX_BLOCKS] = {0};
+    memset(layout->role, 0, sizeof(layout->role));
+    layout->nLive = 0;
+    claimBlock(layout, 0, ROLE_SUPER);
+    claimBlock(layout, 1, ROLE_INODE);
+
+    if (superblock->dedupIndexPtr != -1 && checkClaim(layout, superblock->dedupIndexPtr, ROLE_INDEX, 5, report) < 0 && repair){
+        superblock->dedupIndexPtr = -1;
+        dirty[0] = 1;
+    }
+
+    //live inodes, then the snapshot
+    char *inodeLink = &rootInode->nextInodePtr;
+    int inodeLinkBlock = 1;
+    for (int inSnapshot = 0; inSnapshot < 2; inSnapshot++){
+        while (*inodeLink != -1){
+            int inodeBlock = *inodeLink;
+            if (checkClaim(layout, inodeBlock, ROLE_INODE, 2, report) < 0){
+                if (repair){
+                    *inodeLink = -1;
+                    dirty[inodeLinkBlock] = 1;
+                }
+                break;
+            }
+            Inode *inode = (Inode *) layout->image[inodeBlock];
+
+            char *extentLink = &inode->firstFileExtentPtr;
+            int extentLinkBlock = inodeBlock;
+            int length = 0;
+            while (*extentLink != -1){
+                int extentBlock = *extentLink;
+                //a shared tail was checked with the first file that reached it
+                if (extentBlock >= 0 && extentBlock < layout->nBlocks && layout->role[extentBlock] == ROLE_EXTENT){
+                    refs[extentBlock]++;
+                    for (int steps = 0; steps < layout->nBlocks && extentBlock >= 0 && extentBlock < layout->nBlocks
+                        && layout->role[extentBlock] == ROLE_EXTENT; steps++){
+                        length++;
+                        extentBlock = ((FileExtent *) layout->image[extentBlock])->nextDataBlock;
+                    }
+                    break;
+                }
+                if (checkClaim(layout, extentBlock, ROLE_EXTENT, 4, report) < 0){
+                    if (repair){
+                        *extentLink = -1;
+                        dirty[extentLinkBlock] = 1;
+                    }
+                    break;
+                }
+                refs[extentBlock]++;
+                length++;
+                extentLink = &((FileExtent *) layout->image[extentBlock])->nextDataBlock;
+                extentLinkBlock = extentBlock;
+            }
+
+            //the size has to fit the chain that is actually there
+            int capacity = (inode->flags & INODE_INLINE) ? INLINE_DATA_SIZE : length * (BLOCKSIZE - 3);
+            if (inode->filePointer != inodeBlock || inode->fileSize != length
+                || (!(inode->flags & INODE_COMPRESSED) && inode->dataSize > capacity)){
+                report->badInodes++;
+                if (repair){
+                    inode->filePointer = inodeBlock;
+                    inode->fileSize = length;
+                    if (!(inode->flags & INODE_COMPRESSED) && inode->dataSize > capacity) inode->dataSize = capacity;
+                    dirty[inodeBlock] = 1;
+                }
+            }
+            inodeLink = &inode->nextInodePtr;
+            inodeLinkBlock = inodeBlock;
+        }
+        inodeLink = &superblock->snapshotInodePtr;
+        inodeLinkBlock = 0;
+    }
+
+    //refCount holds the references beyond the first
+    for (int i = 0; i < layout->nBlocks; i++){
+        int expected = (layout->role[i] == ROLE_EXTENT) ? refs[i] - 1 : 0;
+        if (superblock->refCount[i] == expected) continue;
+        report->badRefCounts++;
+        if (repair){
+            superblock->refCount[i] = expected;
+            dirty[0] = 1;
+        }
+    }
+
+    for (int i = 0; i < MAX_BLOCKS; i++){
+        int free = isFreeBlock(superblock, i);
+        if (i >= layout->nBlocks) report->brokenChains += free;
+        else if (free && layout->role[i] != ROLE_NONE) report->crossLinked++;
+        else if (free){
+            layout->role[i] = ROLE_FREE;
+            report->freeBlocks++;
+        }
+        else if (layout->role[i] == ROLE_NONE) report->leakedBlocks++;
+    }
+
+    //a fingerprint of anything but an extent would let dedup share a free block
+    if (superblock->dedupIndexPtr != -1){
+        int indexBlock = superblock->dedupIndexPtr;
+        DedupIndex *index = (DedupIndex *) layout->image[indexBlock];
+        for (int i = 2; i < MAX_BLOCKS; i++){
+            if (index->fingerprint[i - 2] == 0 || (i < layout->nBlocks && layout->role[i] == ROLE_EXTENT)) continue;
+            report->staleFingerprints++;
+            if (repair){
+                index->fingerprint[i - 2] = 0;
+                dirty[indexBlock] = 1;
+            }
+        }
+    }
+
+    int problems = report->badBlocks + report->brokenChains + report->crossLinked + report->badInodes
+        + report->badRefCounts + report->leakedBlocks + report->staleFingerprints;
+    if (repair && problems > 0){
+        //every block nothing live reaches is free
+        memset(superblock->freeMap, 0, sizeof(superblock->freeMap));
+        report->freeBlocks = 0;
+        for (int i = 0; i < layout->nBlocks; i++){
+            if (isLive(layout, i)) continue;
+            setFreeBlock(superblock, i, 1);
+            report->freeBlocks++;
+        }
+        dirty[0] = 1;
+        for (int i = 0; result == 0 && i < layout->nBlocks; i++){
+            if (dirty[i] && writeBlock(disk, i, layout->image[i]) < 0) result = WRITE_ERROR;
+        }
+        if (result == 0){
+            trimFreeBlocks(disk, superblock, superblock->freeMap);
+            report->repaired = 1;
+        }
+        invalidateFileCache(NULL);
+    }
+
+    free(layout);
+    closeDisk(disk);
+    if (result < 0) return result;
+    return problems;
+}
 
 // //main function
 // int main(int argc, char *argv[]){
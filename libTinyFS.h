@@ -5,8 +5,23 @@
 
 #define BLOCKSIZE 256
 #define MAGIC_NUMBER 0x44
+#define FORMAT_VERSION "TFS2" // in the superblock, images from before the free map lack it
 #define DEFAULT_DISK_SIZE 10240 
 #define DEFAULT_DISK_NAME "tinyFSDisk"
+#define MAX_BLOCKS 128 // block pointers are a single signed byte
+#define INLINE_DATA_SIZE (BLOCKSIZE - 18)
+#define INODE_INLINE 0x01 // file data is stored in the inode, no extents
+#define INODE_COMPRESS 0x02 // compress the file on its next write
+#define INODE_COMPRESSED 0x04 // extents hold a stream of compressed chunks
+#define INODE_RESERVED 0x08 // extents past the data are kept, set by tfs_fallocate
+#define GROWTH_RESERVE 4 // growing files get 1/GROWTH_RESERVE of their size as headroom, until the disk runs short
+#define COMPRESS_CHUNK_SIZE 4096
+#define CHUNK_CACHE_ENTRIES 4
+#define REF_PAGES 8 // blocks tfs_readRef can have pinned at once
+#define DURABILITY_NONE 0 // syncing is left to the host
+#define DURABILITY_CLOSE 1 // synced by tfs_closeFile and tfs_unmount
+#define DURABILITY_PERIODIC 2 // synced in the background every few ms
+#define DURABILITY_SYNC 3 // synced before each call that writes returns
 typedef int fileDescriptor;
 
 // superblock structure
@@ -14,8 +29,12 @@ typedef struct {
     unsigned char blockType;
     unsigned char magicNumber;
     unsigned char rootInode;
-    char freeBlockPtr;
-    char emptyBytes[BLOCKSIZE - 4];
+    char dedupIndexPtr; // -1 when dedup is off
+    unsigned char refCount[MAX_BLOCKS]; // references to a block beyond the first
+    char snapshotInodePtr; // inodes frozen by tfs_snapshot, -1 if none
+    unsigned char freeMap[MAX_BLOCKS / 8]; // bit set for each free block
+    char formatVersion[4]; // FORMAT_VERSION, without its terminator
+    char emptyBytes[BLOCKSIZE - 9 - MAX_BLOCKS - MAX_BLOCKS / 8];
 } Superblock;
 
 typedef struct {
@@ -26,7 +45,9 @@ typedef struct {
     char filePointer;
     char nextInodePtr;
     char firstFileExtentPtr;
-    char emptyBytes[BLOCKSIZE - 15];
+    unsigned char flags;
+    unsigned short dataSize; // in bytes
+    char inlineData[INLINE_DATA_SIZE];
 } Inode;
 
 typedef struct{
@@ -36,16 +57,17 @@ typedef struct{
     char data[BLOCKSIZE - 3];
 } FileExtent;
 
+// fingerprints of the extent blocks, used to find duplicates
 typedef struct {
     unsigned char blockType;
     unsigned char magicNumber;
-    char nextFreeBlock; 
-    char emptyBytes[BLOCKSIZE - 3];
-} FreeBlock;
+    unsigned short fingerprint[MAX_BLOCKS - 2]; // of block i + 2, 0 if none
+    char emptyBytes[2];
+} DedupIndex;
 
-char *mountedDiskname;
+extern char *mountedDiskname;
 
-typedef struct {
+typedef struct OpenFileEntry {
     fileDescriptor fileDescriptor;        
     char filename[9];
     struct OpenFileEntry *nextEntry;
@@ -53,12 +75,62 @@ typedef struct {
 
 } OpenFileEntry;
 
-static OpenFileEntry originalFileTable = {-1, "root", NULL, 0};
-static OpenFileEntry *openFileTable = &originalFileTable;
+extern OpenFileEntry *openFileTable;
+
+// fragmentation metrics reported by tfs_fragStats
+typedef struct {
+    int totalBlocks;
+    int usedBlocks;      // superblock, inodes and file extents
+    int freeBlocks;
+    int files;
+    int fileFragments;   // contiguous runs summed over all files
+    int freeRuns;        // contiguous runs of free blocks
+    int misplacedBlocks; // live blocks not yet at their defragmented position
+} FragStats;
+
+// deduplication metrics reported by tfs_dedupStats
+typedef struct {
+    int logicalBlocks;  // extent blocks as seen by files
+    int physicalBlocks; // extent blocks actually on disk
+    int writesSaved;    // block writes skipped by dedup since mount
+} DedupStats;
+
+// problems found by tfs_check
+typedef struct {
+    int badBlocks;    // reached blocks with the wrong type or magic number
+    int brokenChains; // pointers (or free map bits) off the end of the disk
+    int crossLinked;  // blocks reached twice, or both live and free
+    int badInodes;    // inodes whose size or position disagrees with the disk
+    int badRefCounts; // reference counts that do not match the references found
+    int leakedBlocks; // blocks neither live nor free
+    int staleFingerprints; // dedup index entries for blocks that are not extents
+    int freeBlocks;
+    int repaired;     // 1 if tfs_check wrote its fixes to the disk
+} CheckReport;
+
+// operations for tfs_batch
+#define BATCH_OPEN 1
+#define BATCH_READ 2
+#define BATCH_WRITE 3
+#define BATCH_SEEK 4
+#define BATCH_DELETE 5
+#define BATCH_FROM_OP(i) ((i) + 1) // so that zeroed ops refer to no other op
+
+typedef struct {
+    int op;            // BATCH_*
+    char *name;        // file to open
+    fileDescriptor fd; // file to read, write, seek or delete
+    char *buffer;      // data to write, or where to read to
+    int size;          // bytes to write or read, or offset to seek to
+    int result;        // set by tfs_batch: the descriptor opened, bytes read, or success/error code
+    int fdFromOp;      // BATCH_FROM_OP(i) to use the file earlier op i opened instead of fd, 0 for none
+} BatchOp;
 
 
 int tfs_seek(fileDescriptor FD, int offset);
 int tfs_readByte(fileDescriptor FD, char *buffer);
+int tfs_readRef(fileDescriptor FD, int offset, char **ref, int *length);
+int tfs_release(char *ref);
 int tfs_mkfs(char *filename, int nBytes);
 int tfs_deleteFile(fileDescriptor FD);
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
@@ -66,3 +138,17 @@ int tfs_unmount(void);
 int tfs_mount(char *diskname);
 int getInodeFromFD(fileDescriptor FD);
 fileDescriptor tfs_openFile(char *name);
+int tfs_closeFile(fileDescriptor FD);
+int tfs_fragStats(FragStats *stats);
+int tfs_defrag(int maxWrites);
+int tfs_setCompression(fileDescriptor FD, int enabled);
+int tfs_setDedup(int enabled);
+int tfs_dedupStats(DedupStats *stats);
+int tfs_clone(char *srcName, char *dstName);
+int tfs_snapshot(void);
+int tfs_restoreSnapshot(void);
+int tfs_dropSnapshot(void);
+int tfs_check(char *diskname, int repair, CheckReport *report);
+int tfs_batch(BatchOp *ops, int count);
+int tfs_fallocate(fileDescriptor FD, int bytes);
+int tfs_setDurability(int mode, int periodMs);
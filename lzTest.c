@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libLZ.h"
+
+#define MAX_TEST_SIZE 20000
+#define NUM_RANDOM_TESTS 200
+
+/* Compresses and decompresses inputs of every kind libLZ meets, from
+ * empty and incompressible to long runs, and checks each round trip gives
+ * back the input. Decompressing into a buffer that is too small must fail. */
+
+static char input[MAX_TEST_SIZE];
+static char compressed[LZ_BOUND(MAX_TEST_SIZE)];
+static char output[MAX_TEST_SIZE];
+
+static void roundTrip(char *name, int size)
+{
+    int compressedSize = lzCompress(input, size, compressed, LZ_BOUND(size));
+    if (compressedSize < 0 || compressedSize > LZ_BOUND(size))
+    {
+        printf("] Failed to compress %s of %i bytes (%i). Exiting.\n", name, size, compressedSize);
+        exit(1);
+    }
+    int outputSize = lzDecompress(compressed, compressedSize, output, size);
+    if (outputSize != size || memcmp(input, output, size) != 0)
+    {
+        printf("] Round trip of %s of %i bytes gave back %i different bytes. Exiting.\n", name, size, outputSize);
+        exit(1);
+    }
+    if (size > 0 && lzDecompress(compressed, compressedSize, output, size - 1) >= 0)
+    {
+        printf("] Decompressing %s into %i bytes did not fail. Exiting.\n", name, size - 1);
+        exit(1);
+    }
+}
+
+int main()
+{
+    int index, test;
+
+    roundTrip("empty input", 0);
+
+    memset(input, 'a', MAX_TEST_SIZE);
+    roundTrip("a single repeated byte", MAX_TEST_SIZE);
+    printf("] A run of %i bytes compressed and decompressed.\n", MAX_TEST_SIZE);
+
+    for (index = 0; index < MAX_TEST_SIZE; index++)
+        input[index] = rand();
+    roundTrip("random bytes", MAX_TEST_SIZE);
+    printf("] %i random bytes compressed and decompressed.\n", MAX_TEST_SIZE);
+
+    /* short inputs and mixes of matches and literals, matches up to far apart */
+    srand(1);
+    for (test = 0; test < NUM_RANDOM_TESTS; test++)
+    {
+        int size = rand() % (test < NUM_RANDOM_TESTS / 2 ? 2 * LZ_MIN_MATCH + 2 : MAX_TEST_SIZE);
+        int alphabet = 1 + rand() % 16;
+        for (index = 0; index < size; index++)
+        {
+            if (index > LZ_MIN_MATCH && rand() % 4 == 0)
+                input[index] = input[rand() % index];
+            else
+                input[index] = 'a' + rand() % alphabet;
+        }
+        roundTrip("mixed input", size);
+    }
+    printf("] %i inputs of mixed matches and literals compressed and decompressed.\n", NUM_RANDOM_TESTS);
+    printf("] All compression tests passed.\n");
+    return 0;
+}
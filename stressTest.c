@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+#define NUM_FILES 8
+#define MAX_FILE_SIZE 3000
+#define NUM_STEPS 400
+
+/* Usage: stressTest [seed] [disk]
+ * Runs NUM_STEPS random operations on ‘disk’, "mem:stressTest" by default,
+ * keeping a copy of what every file should hold. After each operation
+ * tfs_check must find the disk clean and every file must match its copy. A
+ * failed call must leave the files as they were, except that a write that
+ * runs out of blocks has already let go of the old content and may leave
+ * the file empty. */
+
+typedef struct {
+    int size; /* -1 if the file does not exist */
+    char data[MAX_FILE_SIZE];
+} Model;
+
+static char *diskName;
+static Model files[NUM_FILES];
+static Model snapshot[NUM_FILES];
+static int haveSnapshot;
+
+static void fileName(int file, char *name)
+{
+    sprintf(name, "file%d", file);
+}
+
+static fileDescriptor openModelFile(int file)
+{
+    char name[9];
+    fileName(file, name);
+    fileDescriptor fd = tfs_openFile(name);
+    if (fd >= 0 && files[file].size < 0) files[file].size = 0; /* opening creates it */
+    return fd;
+}
+
+static int isEmpty(int file)
+{
+    char byte;
+    fileDescriptor fd = openModelFile(file);
+    return tfs_seek(fd, 0) == 0 && tfs_readByte(fd, &byte) < 0;
+}
+
+static void verify(int step, char *op)
+{
+    CheckReport report;
+    int file, index, result, same;
+    char byte;
+
+    result = tfs_check(diskName, 0, &report);
+    if (result != 0)
+    {
+        printf("] Step %i (%s): tfs_check found %i problems. Exiting.\n", step, op, result);
+        exit(1);
+    }
+    for (file = 0; file < NUM_FILES; file++)
+    {
+        if (files[file].size < 0) continue;
+        fileDescriptor fd = openModelFile(file);
+        if (fd < 0 || tfs_seek(fd, 0) < 0)
+        {
+            printf("] Step %i (%s): cannot open file%i (%i). Exiting.\n", step, op, file, fd);
+            exit(1);
+        }
+        same = 1;
+        for (index = 0; same && tfs_readByte(fd, &byte) == 0; index++)
+            same = index < files[file].size && byte == files[file].data[index];
+        if (!same || index != files[file].size)
+        {
+            printf("] Step %i (%s): file%i differs from byte #%i on. Exiting.\n", step, op, file, index - !same);
+            exit(1);
+        }
+    }
+}
+
+/* random data, repetitive often enough for compression and dedup to apply */
+static void fillRandom(char *data, int size)
+{
+    int index;
+    int period = 1 + rand() % 300;
+    for (index = 0; index < size; index++)
+        data[index] = (rand() % 3 == 0) ? 'a' + index % period : rand() % 4;
+}
+
+/* One batch that opens ‘file’, writes it, seeks into what was just written
+ * and reads it back, then opens, writes and deletes another file, whose
+ * freed blocks are trimmed only once the batch ends. Every op's result must
+ * match the model. */
+static int batch(int step, int file)
+{
+    BatchOp ops[7];
+    Model written, gone;
+    char name[9], otherName[9], read[MAX_FILE_SIZE];
+    int index, offset, expected, result;
+    int other = (file + 1 + rand() % (NUM_FILES - 1)) % NUM_FILES;
+
+    written.size = rand() % MAX_FILE_SIZE;
+    fillRandom(written.data, written.size);
+    gone.size = rand() % MAX_FILE_SIZE;
+    fillRandom(gone.data, gone.size);
+    offset = rand() % (written.size + 1);
+    fileName(file, name);
+    fileName(other, otherName);
+
+    memset(ops, 0, sizeof(ops));
+    ops[0].op = BATCH_OPEN;
+    ops[0].name = name;
+    ops[1].op = BATCH_WRITE;
+    ops[1].buffer = written.data;
+    ops[1].size = written.size;
+    ops[2].op = BATCH_SEEK;
+    ops[2].size = offset;
+    ops[3].op = BATCH_READ;
+    ops[3].buffer = read;
+    ops[3].size = MAX_FILE_SIZE;
+    for (index = 1; index < 4; index++)
+        ops[index].fdFromOp = BATCH_FROM_OP(0);
+    ops[4].op = BATCH_OPEN;
+    ops[4].name = otherName;
+    ops[5].op = BATCH_WRITE;
+    ops[5].buffer = gone.data;
+    ops[5].size = gone.size;
+    ops[6].op = BATCH_DELETE;
+    for (index = 5; index < 7; index++)
+        ops[index].fdFromOp = BATCH_FROM_OP(4);
+
+    result = tfs_batch(ops, 7);
+    if (result < 0) return result;
+    for (index = 0; index < 7; index++)
+    {
+        int opened = (index < 4) ? 0 : 4;
+        /* the ops on a file that could not be opened have no descriptor */
+        if (index != opened && ops[opened].result < 0 && ops[index].result == INVALID_FD) continue;
+        if (ops[index].result < 0 && ops[index].result != OUT_OF_BLOCKS) return ops[index].result;
+    }
+
+    if (ops[0].result >= 0 && files[file].size < 0) files[file].size = 0;
+    if (ops[1].result == 0) files[file] = written;
+    else if (ops[1].result == OUT_OF_BLOCKS && isEmpty(file)) files[file].size = 0;
+    if (ops[4].result >= 0 && files[other].size < 0) files[other].size = 0;
+    if (ops[5].result == 0) files[other] = gone;
+    if (ops[6].result == 0) files[other].size = -1;
+    else if (ops[5].result == OUT_OF_BLOCKS && isEmpty(other)) files[other].size = 0;
+
+    /* the read sees what the write before it in the batch left */
+    if (ops[3].result >= 0)
+    {
+        expected = (files[file].size > offset) ? files[file].size - offset : 0;
+        if (ops[3].result != expected || memcmp(read, files[file].data + offset, expected) != 0)
+        {
+            printf("] Step %i (batch): read %i bytes from offset %i of file%i, not the %i expected. Exiting.\n",
+                step, ops[3].result, offset, file, expected);
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int step, file, index, result;
+    char *op;
+    Model written;
+    int seed = (argc > 1) ? atoi(argv[1]) : 1;
+    diskName = (argc > 2) ? argv[2] : "mem:stressTest";
+    srand(seed);
+
+    for (file = 0; file < NUM_FILES; file++)
+        files[file].size = -1;
+    if ((result = tfs_mkfs(diskName, MAX_BLOCKS * BLOCKSIZE)) < 0 || (result = tfs_mount(diskName)) < 0)
+    {
+        printf("] Failed to make and mount %s (%i). Exiting.\n", diskName, result);
+        exit(1);
+    }
+
+    for (step = 0; step < NUM_STEPS; step++)
+    {
+        file = rand() % NUM_FILES;
+        switch (rand() % 11)
+        {
+            case 0:
+            case 1:
+            case 2:
+                op = "write";
+                written.size = rand() % MAX_FILE_SIZE;
+                fillRandom(written.data, written.size);
+                result = openModelFile(file);
+                if (result >= 0) result = tfs_writeFile(result, written.data, written.size);
+                if (result == 0) files[file] = written;
+                else if (result == OUT_OF_BLOCKS && isEmpty(file)) files[file].size = 0;
+                break;
+            case 3:
+                op = "delete";
+                if (files[file].size < 0) continue;
+                result = tfs_deleteFile(openModelFile(file));
+                if (result == 0) files[file].size = -1;
+                break;
+            case 4:
+                op = "clone";
+                int source = rand() % NUM_FILES;
+                char sourceName[9], targetName[9];
+                if (files[source].size < 0 || source == file) continue;
+                fileName(source, sourceName);
+                fileName(file, targetName);
+                result = tfs_clone(sourceName, targetName);
+                if (result == 0) files[file] = files[source];
+                break;
+            case 5:
+                op = "snapshot or restore";
+                if (haveSnapshot && rand() % 2)
+                {
+                    result = tfs_restoreSnapshot();
+                    if (result == 0) memcpy(files, snapshot, sizeof(files));
+                }
+                else
+                {
+                    result = tfs_snapshot();
+                    if (result == 0)
+                    {
+                        memcpy(snapshot, files, sizeof(files));
+                        /* a snapshot without files leaves nothing to restore */
+                        haveSnapshot = 0;
+                        for (index = 0; index < NUM_FILES; index++)
+                            haveSnapshot = haveSnapshot || files[index].size >= 0;
+                    }
+                }
+                break;
+            case 6:
+                op = "fallocate";
+                result = openModelFile(file);
+                if (result >= 0) result = tfs_fallocate(result, rand() % 2 ? rand() % (2 * MAX_FILE_SIZE) : 0);
+                break;
+            case 7:
+                op = "compression or dedup";
+                if (rand() % 2)
+                {
+                    result = openModelFile(file);
+                    if (result >= 0) result = tfs_setCompression(result, rand() % 2);
+                }
+                else result = tfs_setDedup(rand() % 2);
+                break;
+            case 8:
+                op = "defrag";
+                result = tfs_defrag(rand() % 2 ? 0 : 1 + rand() % 20);
+                break;
+            case 9:
+                op = "batch";
+                result = batch(step, file);
+                break;
+            default:
+                op = "remount";
+                result = tfs_unmount();
+                if (result == 0) result = tfs_mount(diskName);
+                if (result < 0)
+                {
+                    printf("] Step %i: failed to remount (%i). Exiting.\n", step, result);
+                    exit(1);
+                }
+        }
+        /* running out of blocks is expected, it must not change anything */
+        if (result < 0 && result != OUT_OF_BLOCKS)
+        {
+            printf("] Step %i (%s): failed with %i. Exiting.\n", step, op, result);
+            exit(1);
+        }
+        verify(step, op);
+    }
+    tfs_unmount();
+    printf("] %i random operations with seed %i left %s consistent.\n", NUM_STEPS, seed, diskName);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "libDisk.h"
+
+#define NUM_MEMBERS 3
+#define NUM_BLOCKS 600 /* total number of blocks on each disk */
+#define NUM_RANDOM_REQUESTS 200
+
+/* Usage: stripeTest [directory]
+ * Writes and reads back striped disks of NUM_MEMBERS files in ‘directory’,
+ * "/tmp" by default, for stripe units of one to three blocks. Whole-disk
+ * requests are well above STRIPE_PARALLEL_BYTES, so their members are
+ * served concurrently; the random requests cover the small serial ones. The
+ * member files are read directly to check where each block went. */
+
+static char written[NUM_BLOCKS * BLOCKSIZE];
+static char buffer[NUM_BLOCKS * BLOCKSIZE];
+
+static void fail(char *what, int unit, int result)
+{
+    printf("] %s failed with a stripe unit of %i blocks (%i). Exiting.\n", what, unit, result);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *directory = (argc > 1) ? argv[1] : "/tmp";
+    char diskName[strlen(directory) * NUM_MEMBERS + 64];
+    char memberName[strlen(directory) + 32];
+    int unit, index, result;
+
+    if ((size_t) NUM_BLOCKS * BLOCKSIZE < STRIPE_PARALLEL_BYTES)
+    {
+        printf("] A whole disk is below STRIPE_PARALLEL_BYTES, nothing would run in parallel. Exiting.\n");
+        exit(1);
+    }
+    for (unit = 1; unit <= 3; unit++)
+    {
+        sprintf(diskName, "stripe:%d:%s/stripe0.dsk,%s/stripe1.dsk,%s/stripe2.dsk",
+                unit * BLOCKSIZE, directory, directory, directory);
+        int disk = openDisk(diskName, NUM_BLOCKS * BLOCKSIZE);
+        if (disk < 0) fail("openDisk", unit, disk);
+
+        for (index = 0; index < NUM_BLOCKS * BLOCKSIZE; index++)
+            written[index] = rand();
+        if ((result = writeBlocks(disk, 0, NUM_BLOCKS, written)) < 0) fail("Writing the whole disk", unit, result);
+        memset(buffer, 0, sizeof(buffer));
+        if ((result = readBlocks(disk, 0, NUM_BLOCKS, buffer)) < 0) fail("Reading the whole disk", unit, result);
+        if (memcmp(buffer, written, sizeof(buffer)) != 0) fail("Reading back the whole disk", unit, 0);
+
+        for (index = 0; index < NUM_RANDOM_REQUESTS; index++)
+        {
+            int first = rand() % NUM_BLOCKS;
+            int count = 1 + rand() % (NUM_BLOCKS - first);
+            if ((result = readBlocks(disk, first, count, buffer)) < 0) fail("Reading a range", unit, result);
+            if (memcmp(buffer, written + first * BLOCKSIZE, (size_t) count * BLOCKSIZE) != 0)
+                fail("Reading back a range", unit, first);
+        }
+        if (readBlocks(disk, NUM_BLOCKS - 10, 20, buffer) >= 0) fail("Reading past the end", unit, 0);
+        closeDisk(disk);
+
+        /* block b lives in member (b / unit) % NUM_MEMBERS */
+        for (index = 0; index < NUM_MEMBERS; index++)
+        {
+            sprintf(memberName, "%s/stripe%d.dsk", directory, index);
+            FILE *member = fopen(memberName, "r");
+            if (member == NULL) fail("Opening a member file", unit, index);
+            int block;
+            for (block = 0; block < NUM_BLOCKS; block++)
+            {
+                int stripeUnit = block / unit;
+                if (stripeUnit % NUM_MEMBERS != index) continue;
+                fseek(member, (long) ((stripeUnit / NUM_MEMBERS) * unit + block % unit) * BLOCKSIZE, SEEK_SET);
+                if (fread(buffer, 1, BLOCKSIZE, member) != BLOCKSIZE ||
+                    memcmp(buffer, written + block * BLOCKSIZE, BLOCKSIZE) != 0)
+                    fail("Finding a block in its member file", unit, block);
+            }
+            fclose(member);
+        }
+        printf("] Striped disk with a stripe unit of %i blocks verified.\n", unit);
+    }
+    printf("] All striping tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <time.h>
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+#define BENCH_FILES 4 // files the writes rotate over, also the size of a batch
+#define BENCH_WRITES 200
+#define BENCH_FILE_SIZE 4096
+#define BENCH_PERIOD_MS 10 // flush period of DURABILITY_PERIODIC
+
+static double now(void){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* Rewrites BENCH_FILES files BENCH_WRITES times in all under durability
+‘mode’, one tfs_writeFile at a time or, with ‘batched’, BENCH_FILES of
+them per tfs_batch. Prints the mean and worst latency of a write and the
+throughput, unmount (and so the final sync) included. */
+static int runMode(char *diskname, char *label, int mode, int batched){
+    static char buffer[BENCH_FILE_SIZE];
+    for (int i = 0; i < BENCH_FILE_SIZE; i++) buffer[i] = rand();
+    if (tfs_mkfs(diskname, MAX_BLOCKS * BLOCKSIZE) < 0) return INVALID_DISK;
+    int result = tfs_mount(diskname);
+    if (result == 0) result = tfs_setDurability(mode, BENCH_PERIOD_MS);
+    if (result < 0) return result;
+
+    BatchOp ops[BENCH_FILES];
+    memset(ops, 0, sizeof(ops));
+    for (int i = 0; i < BENCH_FILES; i++){
+        char name[9];
+        sprintf(name, "bench%d", i);
+        ops[i].op = BATCH_WRITE;
+        ops[i].fd = tfs_openFile(name);
+        if (ops[i].fd < 0) return ops[i].fd;
+        ops[i].buffer = buffer;
+        ops[i].size = BENCH_FILE_SIZE;
+    }
+
+    double worst = 0;
+    double start = now();
+    for (int i = 0; i < BENCH_WRITES; i += batched ? BENCH_FILES : 1){
+        double latency = now();
+        if (batched) result = tfs_batch(ops, BENCH_FILES);
+        else result = tfs_writeFile(ops[i % BENCH_FILES].fd, buffer, BENCH_FILE_SIZE);
+        if (result < 0) return result;
+        latency = now() - latency;
+        if (batched) latency /= BENCH_FILES;
+        if (latency > worst) worst = latency;
+    }
+    double writing = now() - start;
+    tfs_unmount();
+    double total = now() - start;
+
+    printf("%-16s %10.1f %10.1f %10.2f\n", label, writing / BENCH_WRITES * 1e6, worst * 1e6,
+        (double) BENCH_WRITES * BENCH_FILE_SIZE / total / 1e6);
+    return 0;
+}
+
+//compares the cost of each durability policy on a disk
+int main(int argc, char *argv[]){
+    //a file in /tmp by default, a RAM disk would have nothing to sync
+    char *diskname = (argc > 1) ? argv[1] : "/tmp/tfsBenchDisk";
+
+    printf("%d writes of %d bytes to %s\n", BENCH_WRITES, BENCH_FILE_SIZE, diskname);
+    printf("%-16s %10s %10s %10s\n", "mode", "mean us", "worst us", "MB/s");
+    int result = runMode(diskname, "none", DURABILITY_NONE, 0);
+    if (result == 0) result = runMode(diskname, "close", DURABILITY_CLOSE, 0);
+    if (result == 0) result = runMode(diskname, "periodic", DURABILITY_PERIODIC, 0);
+    if (result == 0) result = runMode(diskname, "sync", DURABILITY_SYNC, 0);
+    if (result == 0) result = runMode(diskname, "sync, batched", DURABILITY_SYNC, 1);
+    if (result < 0){
+        printf("Error running benchmark, result: %d\n", result);
+        return 1;
+    }
+    return 0;
+}
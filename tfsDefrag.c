@@ -0,0 +1,46 @@
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+static void printStats(char *label, FragStats *stats){
+    printf("%s: %d/%d blocks used, %d files in %d fragments, %d free runs, %d blocks out of place\n",
+        label, stats->usedBlocks, stats->totalBlocks, stats->files, stats->fileFragments,
+        stats->freeRuns, stats->misplacedBlocks);
+}
+
+//defragments a TinyFS disk, optionally limited to maxWrites block writes
+int main(int argc, char *argv[]){
+    if (argc < 2){
+        printf("Usage: %s <diskname> [maxWrites]\n", argv[0]);
+        return 1;
+    }
+
+    char *diskname = argv[1];
+    int maxWrites = (argc > 2) ? atoi(argv[2]) : 0;
+
+    int result = tfs_mount(diskname);
+    if (result < 0){
+        printf("Error mounting disk, result: %d\n", result);
+        return 1;
+    }
+
+    FragStats stats;
+    result = tfs_fragStats(&stats);
+    if (result < 0){
+        printf("Error reading disk layout, result: %d\n", result);
+        return 1;
+    }
+    printStats("before", &stats);
+
+    result = tfs_defrag(maxWrites);
+    if (result < 0){
+        printf("Error defragmenting disk, result: %d\n", result);
+        return 1;
+    }
+
+    tfs_fragStats(&stats);
+    printStats("after", &stats);
+    if (result > 0) printf("%d blocks left to move, run again to continue\n", result);
+
+    tfs_unmount();
+    return 0;
+}
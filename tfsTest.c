@@ -6,9 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "tinyFS.h"
 #include "libTinyFS.h"
-#include "TinyFS_errno.h"
+#include "tinyFS_errno.h"
 
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
 int
@@ -28,10 +27,21 @@ fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
   return 0;
 }
 
-/* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
+/* reports a failed call, the result is the exit status */
 int
-main ()
+failed (char *message)
 {
+  perror (message);
+  return 1;
+}
+
+/* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system.
+ * The disk is DEFAULT_DISK_NAME unless another one is named, e.g. "mem:tfsTest" for a RAM disk. A first run
+ * writes the files, a second run on the same disk reads and deletes them. Exits with 1 if anything failed. */
+int
+main (int argc, char *argv[])
+{
+  char *diskName = (argc > 1) ? argv[1] : DEFAULT_DISK_NAME;
   char readBuffer;
   char *afileContent, *bfileContent;	/* buffers to store file content */
   int afileSize = 200;		/* sizes in bytes */
@@ -41,16 +51,16 @@ main ()
   char phrase2[] = "(b) file content ";
 
   fileDescriptor aFD, bFD;
-  int i, returnValue;
+  int returnValue = 0;
 
 /* try to mount the disk */
-  if (tfs_mount (DEFAULT_DISK_NAME) < 0)	/* if mount fails */
+  if (tfs_mount (diskName) < 0)	/* if mount fails */
     {
-      tfs_mkfs (DEFAULT_DISK_NAME, DEFAULT_DISK_SIZE);	/* then make a new disk */
-      if (tfs_mount (DEFAULT_DISK_NAME) < 0)	/* if we still can't open it... */
+      tfs_mkfs (diskName, DEFAULT_DISK_SIZE);	/* then make a new disk */
+      if (tfs_mount (diskName) < 0)	/* if we still can't open it... */
 	{
 	  perror ("failed to open disk");	/* then just exit */
-	  return;
+	  return 1;
 	}
     }
 
@@ -59,14 +69,14 @@ main ()
   if (fillBufferWithPhrase (phrase1, afileContent, afileSize) < 0)
     {
       perror ("failed");
-      return;
+      return 1;
     }
 
   bfileContent = (char *) malloc (bfileSize * sizeof (char));
   if (fillBufferWithPhrase (phrase2, bfileContent, bfileSize) < 0)
     {
       perror ("failed");
-      return;
+      return 1;
     }
 
 /* print content of files for debugging */
@@ -82,7 +92,7 @@ main ()
 
   if (aFD < 0)
     {
-      perror ("tfs_openFile failed on afile");
+      returnValue = failed ("tfs_openFile failed on afile");
     }
 
 /* now, was there already a file named "afile" that had some content? If we can read from it, yes!
@@ -94,7 +104,7 @@ main ()
       /* if readByte() fails, there was no afile, so we write to it */
       if (tfs_writeFile (aFD, afileContent, afileSize) < 0)
 	{
-	  perror ("tfs_writeFile failed");
+	  returnValue = failed ("tfs_writeFile failed");
 	}
       else
 	printf ("Successfully written to afile\n");
@@ -111,18 +121,18 @@ main ()
 
       /* close file */
       if (tfs_closeFile (aFD) < 0)
-	perror ("tfs_closeFile failed");
+	returnValue = failed ("tfs_closeFile failed");
 
       /* now try to delete the file. It should fail because aFD is no longer valid */
       if (tfs_deleteFile (aFD) < 0)
 	{
 	  aFD = tfs_openFile ("afile");	/* so we open it again */
 	  if (tfs_deleteFile (aFD) < 0)
-	    perror ("tfs_deleteFile failed");
+	    returnValue = failed ("tfs_deleteFile failed");
 
 	}
       else
-	perror ("tfs_deleteFile should have failed");
+	returnValue = failed ("tfs_deleteFile should have failed");
 
     }
 
@@ -131,14 +141,14 @@ main ()
 
   if (bFD < 0)
     {
-      perror ("tfs_openFile failed on bfile");
+      returnValue = failed ("tfs_openFile failed on bfile");
     }
 
   if (tfs_readByte (bFD, &readBuffer) < 0)
     {
       if (tfs_writeFile (bFD, bfileContent, bfileSize) < 0)
 	{
-	  perror ("tfs_writeFile failed");
+	  returnValue = failed ("tfs_writeFile failed");
 	}
       else
 	printf ("Successfully written to bfile\n");
@@ -156,8 +166,8 @@ main ()
   free (bfileContent);
   free (afileContent);
   if (tfs_unmount () < 0)
-    perror ("tfs_unmount failed");
+    returnValue = failed ("tfs_unmount failed");
 
   printf ("\nend of demo\n\n");
-  return 0;
+  return returnValue;
 }
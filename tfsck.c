@@ -0,0 +1,30 @@
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+//checks a TinyFS disk for consistency, repairing it with -r
+int main(int argc, char *argv[]){
+    if (argc < 2){
+        printf("Usage: %s <diskname> [-r]\n", argv[0]);
+        return 1;
+    }
+
+    char *diskname = argv[1];
+    int repair = (argc > 2 && strcmp(argv[2], "-r") == 0);
+
+    CheckReport report;
+    int result = tfs_check(diskname, repair, &report);
+    if (result < 0){
+        printf("Error checking disk, result: %d\n", result);
+        return 1;
+    }
+
+    printf("%d bad blocks, %d broken chains, %d cross-linked blocks, %d bad inodes\n",
+        report.badBlocks, report.brokenChains, report.crossLinked, report.badInodes);
+    printf("%d bad reference counts, %d leaked blocks, %d stale fingerprints, %d free blocks\n",
+        report.badRefCounts, report.leakedBlocks, report.staleFingerprints, report.freeBlocks);
+    if (result == 0) printf("%s is clean\n", diskname);
+    else if (report.repaired) printf("%d problems repaired\n", result);
+    else printf("%d problems found, run with -r to repair\n", result);
+
+    return (result > 0 && !report.repaired) ? 1 : 0;
+}
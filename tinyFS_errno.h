@@ -6,3 +6,10 @@
 #define INVALID_FD -7
 #define OUT_OF_BLOCKS -8
 #define NO_INODE_MATCHING_FD -9
+#define FS_INCONSISTENT -10
+#define FILE_TOO_LARGE -11
+#define TOO_MANY_REFERENCES -12
+#define NO_SNAPSHOT -13
+#define INVALID_REF -14
+#define INVALID_OP -15
+#define INVALID_MODE -16